@@ -0,0 +1,436 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#define PORT ((1<<13)+5)
+#define VOTE_LEN sizeof(struct VoteMessage)
+#define MAX_PARTICIPANTS 1024
+// above any state a STATE_REPORT carries in flags
+#define BATCH (1<<16)
+#define MAX_BATCH 128
+#define BATCH_BUFFER_LEN (sizeof(struct BatchHeader) + sizeof(int) * MAX_PARTICIPANTS + VOTE_LEN * MAX_BATCH)
+#define SOCKET_BUFFER_SIZE (4<<20)
+#define BENCH_LOG_PATH "/tmp/2pc_bench.log"
+#define SUB_LOG_PATH_FORMAT "/tmp/2pc_bench_%d.log"
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, ACK, DECISION_REQUEST, VOTE_READONLY, COMMIT_REQUEST,
+    PRE_COMMIT, PRE_COMMIT_ACK, STATE_REPORT, KV_GET, KV_VALUE,
+    HEARTBEAT};
+
+struct VoteMessage {
+	int flags;
+	int txn;
+	enum MSG_TYPE msg;
+};
+
+struct VoteRequest {
+    struct VoteMessage vote;
+    int num_participants;
+    int participants[MAX_PARTICIPANTS];
+};
+
+struct BatchHeader {
+    int flags;
+    int count;
+    int num_participants;
+};
+
+// A reply a simulated participant owes the coordinator that asked, root or
+// sub-coordinator, once its vote latency has passed. Pending replies form a
+// min-heap on their due time. Replies to batched messages are batched too.
+struct Reply {
+    long long due;
+    int participant;
+    int port;
+    int txn;
+    int batched;
+    enum MSG_TYPE msg;
+};
+
+// Due replies of one participant waiting to share a datagram.
+struct ReplyBatch {
+    int port;
+    struct BatchHeader header;
+    struct VoteMessage votes[MAX_BATCH];
+};
+
+struct ReplyHeap {
+    struct Reply* replies;
+    int size;
+    int capacity;
+};
+
+int vote_latency_us = 0;
+double abort_percent = 0;
+double loss_percent = 0;
+long long messages_received = 0;
+long long datagrams_received = 0;
+long long messages_dropped = 0;
+
+long long getMonotonicTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int chance(double percent) {
+    return percent > 0 && rand() < percent / 100.0 * RAND_MAX;
+}
+
+void pushReply(struct ReplyHeap* heap, struct Reply* reply) {
+    if(heap->size == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity << 1 : 1024;
+        heap->replies = (struct Reply*)realloc(heap->replies, sizeof(struct Reply) * heap->capacity);
+    }
+    int i = heap->size++;
+    while(i > 0 && heap->replies[(i - 1) / 2].due > reply->due) {
+        heap->replies[i] = heap->replies[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->replies[i] = *reply;
+}
+
+void popReply(struct ReplyHeap* heap) {
+    struct Reply last = heap->replies[--heap->size];
+    int i = 0;
+    for(;;) {
+        int child = 2 * i + 1;
+        if(child >= heap->size) {
+            break;
+        }
+        if(child + 1 < heap->size && heap->replies[child + 1].due < heap->replies[child].due) {
+            child++;
+        }
+        if(heap->replies[child].due >= last.due) {
+            break;
+        }
+        heap->replies[i] = heap->replies[child];
+        i = child;
+    }
+    heap->replies[i] = last;
+}
+
+int createParticipantSocket(int port) {
+    int sock;
+    if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        handle_error("socket()");
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = port;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+        handle_error("bind()");
+    }
+    int size = SOCKET_BUFFER_SIZE;
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) < 0) {
+        handle_error("setsockopt()");
+    }
+    return sock;
+}
+
+// Same replies as process.c with a fixed policy, minus the log: votes are
+// delayed by the vote latency, and both directions lose packets at random.
+void handleMessage(struct ReplyHeap* heap, int participant, struct VoteMessage* vote, int batched, struct sockaddr_in* addr) {
+    messages_received++;
+    if(chance(loss_percent)) {
+        messages_dropped++;
+        return;
+    }
+    struct Reply reply;
+    reply.participant = participant;
+    reply.port = addr->sin_port;
+    reply.txn = vote->txn;
+    reply.batched = batched;
+    reply.due = getMonotonicTimeUs();
+    if(vote->msg == VOTE_REQUEST || vote->msg == COMMIT_REQUEST) {
+        reply.msg = chance(abort_percent) ? VOTE_ABORT : VOTE_COMMIT;
+        reply.due += vote_latency_us;
+    } else if(vote->msg == GLOBAL_COMMIT) {
+        reply.msg = ACK;
+    } else if(vote->msg == PRE_COMMIT) {
+        reply.msg = PRE_COMMIT_ACK;
+    } else {
+        return;
+    }
+    pushReply(heap, &reply);
+}
+
+void sendReply(int sock, void* buffer, size_t len, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = port;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sendto(sock, buffer, len, 0, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+        handle_error("sendto()");
+    }
+}
+
+void sendReplyBatch(int sock, struct ReplyBatch* batch) {
+    if(batch->header.count > 0) {
+        sendReply(sock, &batch->header, sizeof(struct BatchHeader) + VOTE_LEN * batch->header.count, batch->port);
+        batch->header.count = 0;
+    }
+}
+
+void sendDueReplies(struct ReplyHeap* heap, int* socks, struct ReplyBatch* batches, int num_participants) {
+    long long now = getMonotonicTimeUs();
+    int batched = 0;
+    while(heap->size > 0 && heap->replies[0].due <= now) {
+        struct Reply* reply = &heap->replies[0];
+        struct VoteMessage vote;
+        vote.flags = 0;
+        vote.txn = reply->txn;
+        vote.msg = reply->msg;
+        if(chance(loss_percent)) {
+            messages_dropped++;
+        } else if(reply->batched) {
+            struct ReplyBatch* batch = &batches[reply->participant];
+            if(batch->header.count == MAX_BATCH || (batch->header.count > 0 && batch->port != reply->port)) {
+                sendReplyBatch(socks[reply->participant], batch);
+            }
+            batch->port = reply->port;
+            batch->votes[batch->header.count++] = vote;
+            batched = 1;
+        } else {
+            sendReply(socks[reply->participant], &vote, VOTE_LEN, reply->port);
+        }
+        popReply(heap);
+    }
+    for(int i = 0; batched && i < num_participants; i++) {
+        sendReplyBatch(socks[i], &batches[i]);
+    }
+}
+
+// A batch is only trusted as far as the datagram that carried it reaches.
+int isValidBatch(struct BatchHeader* header, int len) {
+    if(header->count < 0 || header->count > MAX_BATCH || header->num_participants < 0 || header->num_participants > MAX_PARTICIPANTS) {
+        return 0;
+    }
+    return len >= (int)(sizeof(struct BatchHeader) + sizeof(int) * header->num_participants + VOTE_LEN * header->count);
+}
+
+void receiveMessages(struct ReplyHeap* heap, struct pollfd* pfds, int num_participants) {
+    char buffer[BATCH_BUFFER_LEN];
+    struct BatchHeader* header = (struct BatchHeader*)buffer;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(struct sockaddr);
+    for(int i = 0; i < num_participants; i++) {
+        if(!(pfds[i].revents & POLLIN)) {
+            continue;
+        }
+        int len;
+        while((len = recvfrom(pfds[i].fd, buffer, BATCH_BUFFER_LEN, MSG_DONTWAIT, (struct sockaddr*)&addr, &addrlen)) >= 0) {
+            datagrams_received++;
+            if(!(header->flags & BATCH)) {
+                handleMessage(heap, i, (struct VoteMessage*)buffer, 0, &addr);
+                continue;
+            }
+            if(!isValidBatch(header, len)) {
+                continue;
+            }
+            struct VoteMessage* votes = (struct VoteMessage*)(buffer + sizeof(struct BatchHeader) + sizeof(int) * header->num_participants);
+            for(int v = 0; v < header->count; v++) {
+                handleMessage(heap, i, &votes[v], 1, &addr);
+            }
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            handle_error("recv()");
+        }
+    }
+}
+
+double getCpuTimeUs(struct rusage* usage) {
+    return usage->ru_utime.tv_sec * 1e6 + usage->ru_utime.tv_usec + usage->ru_stime.tv_sec * 1e6 + usage->ru_stime.tv_usec;
+}
+
+pid_t startCoordinator(char* coordinator, char** coordinator_argv) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) {
+        handle_error("fork()");
+    } else if(pid == 0) {
+        execv(coordinator, coordinator_argv);
+        handle_error("execv()");
+    }
+    return pid;
+}
+
+// Sub-coordinator i listens on PORT + 1 + i and owns participants
+// [i * group_size, (i + 1) * group_size).
+pid_t startSubCoordinator(char* coordinator, int sub, int group_size, int num_participants) {
+    char** sub_argv = (char**)malloc(sizeof(char*) * (group_size + 8));
+    char* port = (char*)malloc(16);
+    char* log_path = (char*)malloc(64);
+    sprintf(port, "%d", PORT + 1 + sub);
+    sprintf(log_path, SUB_LOG_PATH_FORMAT, PORT + 1 + sub);
+    unlink(log_path);
+    int n = 0;
+    sub_argv[n++] = coordinator;
+    sub_argv[n++] = "-q";
+    sub_argv[n++] = "-s";
+    sub_argv[n++] = port;
+    sub_argv[n++] = "-l";
+    sub_argv[n++] = log_path;
+    for(int i = sub * group_size; i < (sub + 1) * group_size && i < num_participants; i++) {
+        sub_argv[n] = (char*)malloc(16);
+        sprintf(sub_argv[n++], "%d", (PORT<<1) + i + 1);
+    }
+    sub_argv[n] = NULL;
+    return startCoordinator(coordinator, sub_argv);
+}
+
+// ./commit_bench [-p PARTICIPANTS] [-n NUM_TXNS] [-w WINDOW] [-t TIMEOUT_MS] [-v VOTE_LATENCY_US] [-a ABORT_PERCENT]
+//                [-d LOSS_PERCENT] [-g GROUP_SIZE] [-c COORDINATOR] [-- COORDINATOR_OPTIONS]
+// Runs the real coordinator against simulated participants multiplexed in this process.
+// With -g the root coordinates one sub-coordinator per GROUP_SIZE participants instead.
+int main(int argc, char **argv) {
+    int num_participants = 100;
+    char* num_txns = "10000";
+    char* window = "256";
+    char* timeout = "1000";
+    char* coordinator = "./coordinator";
+    int group_size = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "p:n:w:t:v:a:d:g:c:")) != -1) {
+        if(opt == 'p') {
+            num_participants = atoi(optarg);
+        } else if(opt == 'n') {
+            num_txns = optarg;
+        } else if(opt == 'w') {
+            window = optarg;
+        } else if(opt == 't') {
+            timeout = optarg;
+        } else if(opt == 'v') {
+            vote_latency_us = atoi(optarg);
+        } else if(opt == 'a') {
+            abort_percent = atof(optarg);
+        } else if(opt == 'd') {
+            loss_percent = atof(optarg);
+        } else if(opt == 'g') {
+            group_size = atoi(optarg);
+        } else if(opt == 'c') {
+            coordinator = optarg;
+        } else {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(num_participants < 1 || num_participants > MAX_PARTICIPANTS) {
+        fprintf(stderr, "Between 1 and %d participants are supported\n", MAX_PARTICIPANTS);
+        exit(EXIT_FAILURE);
+    }
+
+    srand(time(NULL));
+    int* socks = (int*)malloc(sizeof(int) * num_participants);
+    struct ReplyBatch* batches = (struct ReplyBatch*)calloc(num_participants, sizeof(struct ReplyBatch));
+    struct pollfd* pfds = (struct pollfd*)malloc(sizeof(struct pollfd) * num_participants);
+    char** coordinator_argv = (char**)malloc(sizeof(char*) * (num_participants + argc + 12));
+    int n = 0;
+    coordinator_argv[n++] = coordinator;
+    coordinator_argv[n++] = "-q";
+    coordinator_argv[n++] = "-n";
+    coordinator_argv[n++] = num_txns;
+    coordinator_argv[n++] = "-w";
+    coordinator_argv[n++] = window;
+    coordinator_argv[n++] = "-t";
+    coordinator_argv[n++] = timeout;
+    coordinator_argv[n++] = "-l";
+    coordinator_argv[n++] = BENCH_LOG_PATH;
+    for(int i = optind; i < argc; i++) {
+        coordinator_argv[n++] = argv[i];
+    }
+    for(int i = 0; i < num_participants; i++) {
+        int port = (PORT<<1) + i + 1;
+        socks[i] = createParticipantSocket(port);
+        pfds[i].fd = socks[i];
+        pfds[i].events = POLLIN;
+        batches[i].header.flags = BATCH;
+        if(group_size == 0) {
+            coordinator_argv[n] = (char*)malloc(16);
+            sprintf(coordinator_argv[n++], "%d", port);
+        }
+    }
+    int num_subs = (group_size > 0) ? (num_participants + group_size - 1) / group_size : 0;
+    pid_t* subs = (pid_t*)malloc(sizeof(pid_t) * (num_subs + 1));
+    for(int i = 0; i < num_subs; i++) {
+        subs[i] = startSubCoordinator(coordinator, i, group_size, num_participants);
+        coordinator_argv[n] = (char*)malloc(16);
+        sprintf(coordinator_argv[n++], "%d", PORT + 1 + i);
+    }
+    coordinator_argv[n] = NULL;
+    // give the sub-coordinators time to bind before the root starts voting
+    if(num_subs > 0) {
+        usleep(200000);
+    }
+
+    // every run starts from an empty decision log
+    unlink(BENCH_LOG_PATH);
+    pid_t pid = startCoordinator(coordinator, coordinator_argv);
+
+    struct ReplyHeap heap;
+    memset(&heap, 0, sizeof(struct ReplyHeap));
+    int status;
+    while(waitpid(pid, &status, WNOHANG) == 0) {
+        int wait_ms = 10;
+        if(heap.size > 0) {
+            long long until_due = heap.replies[0].due - getMonotonicTimeUs();
+            wait_ms = (until_due <= 0) ? 0 : (int)((until_due + 999) / 1000);
+            if(wait_ms > 10) {
+                wait_ms = 10;
+            }
+        }
+        if(poll(pfds, num_participants, wait_ms) < 0 && errno != EINTR) {
+            handle_error("poll()");
+        }
+        receiveMessages(&heap, pfds, num_participants);
+        sendDueReplies(&heap, socks, batches, num_participants);
+    }
+
+    // only the root has been reaped so far, so this is its CPU alone
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    double root_cpu_us = getCpuTimeUs(&usage);
+    for(int i = 0; i < num_subs; i++) {
+        kill(subs[i], SIGTERM);
+        waitpid(subs[i], NULL, 0);
+    }
+    getrusage(RUSAGE_CHILDREN, &usage);
+    double all_cpu_us = getCpuTimeUs(&usage);
+
+    printf("participants=%d sub-coordinators=%d vote_latency=%dus abort=%.2f%% loss=%.2f%%\n", num_participants, num_subs,
+            vote_latency_us, abort_percent, loss_percent);
+    printf("Participants received %lld messages in %lld datagrams, dropped %lld\n", messages_received, datagrams_received,
+            messages_dropped);
+    printf("Coordinator CPU %.1f us per transaction", root_cpu_us / atoi(num_txns));
+    if(num_subs > 0) {
+        printf(" at the root, %.1f us across the tree", all_cpu_us / atoi(num_txns));
+    }
+    printf("\n");
+
+    for(int i = 0; i < num_participants; i++) {
+        close(socks[i]);
+    }
+    free(batches);
+    free(subs);
+    free(heap.replies);
+    free(pfds);
+    free(socks);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
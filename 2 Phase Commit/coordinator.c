@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdlib.h>
@@ -10,26 +11,141 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include "txlog.h"
+#include "failure_detector.h"
 
 #define PORT ((1<<13)+5)
 #define VOTE_LEN sizeof(struct VoteMessage)
+#define MAX_PARTICIPANTS 1024
+#define THREE_PHASE 1
+// above any state a STATE_REPORT carries in flags
+#define BATCH (1<<16)
+#define MAX_BATCH 128
+#define BATCH_BUFFER_LEN (sizeof(struct BatchHeader) + sizeof(int) * MAX_PARTICIPANTS + VOTE_LEN * MAX_BATCH)
+#define VOTE_TIMEOUT_MS (120*1000)
+#define TXN_TABLE_SIZE 4096
+#define SOCKET_BUFFER_SIZE (4<<20)
+#define DEFAULT_WINDOW 256
+#define LOG_PATH "/tmp/2pc_coordinator.log"
+#define SUB_LOG_PATH_FORMAT "/tmp/2pc_coordinator_%d.log"
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, ACK};
+enum MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, ACK, DECISION_REQUEST, VOTE_READONLY, COMMIT_REQUEST,
+    PRE_COMMIT, PRE_COMMIT_ACK, STATE_REPORT, KV_GET, KV_VALUE,
+    HEARTBEAT};
 enum RETRY {DIE, DONT_DIE};
 
-enum MSG_TYPE STATE = INIT;
-
 struct sockaddr** client_addrs;
 int num_clients;
+int verbose = 1;
+int confirm_commit = 0;
+int one_phase = 0;
+int three_phase = 0;
+int failure_percent = 0;
+long long messages_sent = 0;
+int sub_port = 0;
+struct sockaddr_in parent_addr;
+volatile sig_atomic_t running = 1;
+int batch_size = 0;
+int* participant_ports;
+int vote_timeout_ms = VOTE_TIMEOUT_MS;
+struct FailureDetector* detectors;
+char* suspected;
 
 struct VoteMessage {
 	int flags;
+	int txn;
 	enum MSG_TYPE msg;
 };
 
+// VOTE_REQUEST carries the ports of everyone asked to vote, so a blocked
+// participant knows which peers to ask for the outcome.
+struct VoteRequest {
+    struct VoteMessage vote;
+    int num_participants;
+    int participants[MAX_PARTICIPANTS];
+};
+
+// A batch carries the messages of many transactions for one participant in a
+// single datagram: this header (flags has BATCH set, where a lone message has
+// its own flags), the participant ports when it holds a VOTE_REQUEST, then
+// count VoteMessages.
+struct BatchHeader {
+    int flags;
+    int count;
+    int num_participants;
+};
+
+// Messages for one participant waiting to share a datagram.
+struct Batch {
+    struct BatchHeader header;
+    struct VoteMessage votes[MAX_BATCH];
+};
+
+struct Batch* batches;
+
+// Per-transaction state machine. Transactions are chained into the hash table
+// by id and, in start order, into a FIFO; every transaction gets the same
+// timeout, so the FIFO head always carries the earliest deadline. voted[i]
+// holds the vote participant i cast, 0 until it does, and PRE_COMMIT_ACK
+// once a three-phase participant has acknowledged PRE_COMMIT. A
+// sub-coordinator's transaction is delegated when its parent sent a
+// one-phase COMMIT_REQUEST and left the decision to us.
+struct Transaction {
+    int txn;
+    enum MSG_TYPE state;
+    int delegated;
+    int count_votes;
+    int count_prepared;
+    int count_pre_commit_acks;
+    char* voted;
+    long long started;
+    long long deadline;
+    int off_fifo;
+    struct Transaction* next;
+    struct Transaction* next_deadline;
+};
+
+// Presumed abort: only commits are logged and remembered, until every
+// prepared participant has acknowledged them. A recovered decision has no
+// prepared set and is kept for good. In three-phase mode PRE_COMMIT is
+// logged the same way first; INIT marks a transaction we "crashed" on.
+// durable is set once the decision's log record has been synced, and only
+// then is it told to anyone who asks.
+struct Decision {
+    int txn;
+    enum MSG_TYPE decision;
+    char* prepared;
+    int pending_acks;
+    int reply_parent;
+    int durable;
+    struct Decision* next;
+};
+
+// Commits are only multicast once their log record is durable; until the
+// next group flush they wait in the outbox.
+struct TransactionTable {
+    struct Transaction* buckets[TXN_TABLE_SIZE];
+    struct Decision* decisions[TXN_TABLE_SIZE];
+    struct Transaction* oldest;
+    struct Transaction* newest;
+    int inflight;
+    int committed;
+    int aborted;
+    int failed;
+    long long* latency;
+    int num_latency;
+    struct TxLog* log;
+    struct Decision** outbox;
+    int num_outbox;
+    int outbox_capacity;
+    long long phase_two_messages;
+};
+
 char* getMessageTag(enum MSG_TYPE msg) {
     if(msg == START_2PC) {
         return "START2PC";
@@ -47,6 +163,18 @@ char* getMessageTag(enum MSG_TYPE msg) {
         return "GLOBAL_ABORT";
     } else if(msg == ACK) {
         return "ACK";
+    } else if(msg == DECISION_REQUEST) {
+        return "DECISION_REQUEST";
+    } else if(msg == VOTE_READONLY) {
+        return "VOTE_READONLY";
+    } else if(msg == COMMIT_REQUEST) {
+        return "COMMIT_REQUEST";
+    } else if(msg == PRE_COMMIT) {
+        return "PRE_COMMIT";
+    } else if(msg == PRE_COMMIT_ACK) {
+        return "PRE_COMMIT_ACK";
+    } else if(msg == STATE_REPORT) {
+        return "STATE_REPORT";
     } else {
         return "UNK";
     }
@@ -69,81 +197,200 @@ char* getMessageDetails(enum MSG_TYPE msg) {
         return "Sending GLOBAL_ABORT to all participants...";
     } else if(msg == ACK) {
         return "ACK";
+    } else if(msg == DECISION_REQUEST) {
+        return "Answering DECISION_REQUEST from a participant...";
+    } else if(msg == VOTE_READONLY) {
+        return "Every participant is read-only, skipping phase two...";
+    } else if(msg == COMMIT_REQUEST) {
+        return "Sending one-phase COMMIT_REQUEST to the only participant...";
+    } else if(msg == PRE_COMMIT) {
+        return "Sending PRE_COMMIT to all participants...";
+    } else if(msg == PRE_COMMIT_ACK) {
+        return "Received PRE_COMMIT_ACK from all participants...";
+    } else if(msg == STATE_REPORT) {
+        return "STATE_REPORT";
     } else {
         return "UNK";
     }
 }
 
+void freeTransaction(struct Transaction* t);
+void sendToParent(int sock, int txn, enum MSG_TYPE msg);
+
 void LOG(enum MSG_TYPE msg) {
-    printf("[%s] %s\n", getMessageTag(msg), getMessageDetails(msg));
+    if(verbose) {
+        printf("[%s] %s\n", getMessageTag(msg), getMessageDetails(msg));
+    }
 }
 
-void consoleLogSend(enum MSG_TYPE msg, struct sockaddr* addr) {
-    printf("[LOG] Sending %s to client %d\n", getMessageTag(msg), ((struct sockaddr_in*)addr)->sin_port);
+void consoleLogSend(enum MSG_TYPE msg, int txn, struct sockaddr* addr) {
+    if(verbose && msg != HEARTBEAT) {
+        printf("[LOG] Sending %s for transaction %d to client %d\n", getMessageTag(msg), txn, ((struct sockaddr_in*)addr)->sin_port);
+    }
 }
 
-void consoleLogReceive(enum MSG_TYPE msg, struct sockaddr* addr) {
-    printf("[LOG] Received %s from client %d\n", getMessageTag(msg), ((struct sockaddr_in*)addr)->sin_port);
+void consoleLogReceive(enum MSG_TYPE msg, int txn, struct sockaddr* addr) {
+    if(verbose) {
+        printf("[LOG] Received %s for transaction %d from client %d\n", getMessageTag(msg), txn, ((struct sockaddr_in*)addr)->sin_port);
+    }
 }
 
-int sendClientVote(int sock, struct VoteMessage* vote, struct sockaddr* addr) {
-	return sendto(sock, vote, VOTE_LEN, 0, addr, sizeof(struct sockaddr));
+int getClientVote(int sock, char* buffer, struct sockaddr* addr) {
+    socklen_t addrlen = sizeof(struct sockaddr);
+    return recvfrom(sock, buffer, BATCH_BUFFER_LEN, MSG_DONTWAIT, addr, &addrlen);
 }
 
-void sendVote(int sock, enum MSG_TYPE msg, struct sockaddr* addr) {
-    struct VoteMessage vote;
-    vote.msg = msg;
-    if(sendClientVote(sock, &vote, addr) < 0) {
-        handle_error("sendVote()");
+// Points iov at the header, the participant list if needed, and the votes,
+// so a batch goes out without being copied.
+void prepareBatchMessage(int client, struct msghdr* hdr, struct iovec* iov) {
+    struct Batch* batch = &batches[client];
+    int n = 0;
+    iov[n].iov_base = &batch->header;
+    iov[n++].iov_len = sizeof(struct BatchHeader);
+    if(batch->header.num_participants > 0) {
+        iov[n].iov_base = participant_ports;
+        iov[n++].iov_len = sizeof(int) * num_clients;
     }
+    iov[n].iov_base = batch->votes;
+    iov[n++].iov_len = VOTE_LEN * batch->header.count;
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_name = client_addrs[client];
+    hdr->msg_namelen = sizeof(struct sockaddr);
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = n;
 }
 
-int getClientVote(int sock, struct VoteMessage* vote, struct sockaddr* addr) {
-    if(addr == NULL) {
-        return recv(sock, (struct VoteMessage*)vote, VOTE_LEN, 0);
-    } else {
-        socklen_t addrlen = sizeof(struct sockaddr);
-	    return recvfrom(sock, (struct VoteMessage*)vote, VOTE_LEN, 0, addr, &addrlen);
+void resetBatch(int client) {
+    batches[client].header.count = 0;
+    batches[client].header.num_participants = 0;
+}
+
+void sendBatch(int sock, int client) {
+    struct msghdr hdr;
+    struct iovec iov[3];
+    prepareBatchMessage(client, &hdr, iov);
+    if(sendmsg(sock, &hdr, 0) < 0) {
+        handle_error("sendmsg()");
     }
+    messages_sent++;
+    resetBatch(client);
 }
 
-void multicastVoteMessage(int sock, enum MSG_TYPE msg) {
+// Sends every non-empty batch, one datagram per participant, in one sendmmsg.
+void flushBatches(int sock) {
+    if(batch_size == 0) {
+        return;
+    }
+    struct mmsghdr* msgs = (struct mmsghdr*)calloc(num_clients, sizeof(struct mmsghdr));
+    struct iovec* iov = (struct iovec*)malloc(sizeof(struct iovec) * 3 * num_clients);
+    int count = 0;
     for(int i = 0; i < num_clients; i++) {
-        consoleLogSend(msg, client_addrs[i]);
-        sendVote(sock, msg, client_addrs[i]);
-    }
-}
-
-void waitForVote(int sock, struct VoteMessage* vote, struct sockaddr* addr, enum RETRY retry) {
-	int status = getClientVote(sock, vote, addr);
-    if(status < 0) {
-		if(errno == EAGAIN || errno == EWOULDBLOCK) {
-			if(retry == DONT_DIE) {
-				errno = -1;
-				return waitForVote(sock, vote, addr, DONT_DIE);
-			}
-            LOG(GLOBAL_ABORT);
-            multicastVoteMessage(sock, GLOBAL_ABORT);
-		}
-        exit(EXIT_FAILURE);
-	}
+        if(batches[i].header.count > 0) {
+            prepareBatchMessage(i, &msgs[count].msg_hdr, iov + 3 * count);
+            count++;
+        }
+    }
+    int sent = 0;
+    while(sent < count) {
+        int status = sendmmsg(sock, msgs + sent, count - sent, 0);
+        if(status < 0) {
+            handle_error("sendmmsg()");
+        }
+        sent += status;
+    }
+    for(int i = 0; i < num_clients; i++) {
+        resetBatch(i);
+    }
+    messages_sent += count;
+    free(iov);
+    free(msgs);
 }
 
-void setTimeout(int sock, int duration) {
-	struct timeval to;      
-    to.tv_sec = duration;
-    to.tv_usec = 0;
-	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&to, sizeof(struct timeval)) < 0) {
-		handle_error("setsockopt()");
-	}
+void batchVoteMessage(int sock, int client, struct VoteMessage* vote) {
+    struct Batch* batch = &batches[client];
+    if(batch->header.count == batch_size) {
+        sendBatch(sock, client);
+    }
+    consoleLogSend(vote->msg, vote->txn, client_addrs[client]);
+    batch->votes[batch->header.count++] = *vote;
+    if(vote->msg == VOTE_REQUEST) {
+        batch->header.num_participants = num_clients;
+    }
+}
+
+// The whole fan-out goes to the kernel as one sendmmsg batch, or with -b
+// waits to share a datagram with other transactions' messages. A NULL
+// recipients set means every participant.
+int multicastVoteMessage(int sock, int txn, enum MSG_TYPE msg, const char* recipients) {
+    struct VoteRequest request;
+    request.vote.flags = three_phase ? THREE_PHASE : 0;
+    request.vote.txn = txn;
+    request.vote.msg = msg;
+    if(batch_size > 0) {
+        int count = 0;
+        for(int i = 0; i < num_clients; i++) {
+            if(recipients == NULL || recipients[i]) {
+                batchVoteMessage(sock, i, &request.vote);
+                count++;
+            }
+        }
+        return count;
+    }
+    struct iovec iov;
+    iov.iov_base = &request;
+    iov.iov_len = VOTE_LEN;
+    if(msg == VOTE_REQUEST) {
+        request.num_participants = num_clients;
+        for(int i = 0; i < num_clients; i++) {
+            request.participants[i] = ((struct sockaddr_in*)client_addrs[i])->sin_port;
+        }
+        iov.iov_len = sizeof(struct VoteRequest) - sizeof(int) * (MAX_PARTICIPANTS - num_clients);
+    }
+    struct mmsghdr* msgs = (struct mmsghdr*)calloc(num_clients, sizeof(struct mmsghdr));
+    int count = 0;
+    for(int i = 0; i < num_clients; i++) {
+        if(recipients != NULL && !recipients[i]) {
+            continue;
+        }
+        consoleLogSend(msg, txn, client_addrs[i]);
+        msgs[count].msg_hdr.msg_name = client_addrs[i];
+        msgs[count].msg_hdr.msg_namelen = sizeof(struct sockaddr);
+        msgs[count].msg_hdr.msg_iov = &iov;
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        count++;
+    }
+    int sent = 0;
+    while(sent < count) {
+        int status = sendmmsg(sock, msgs + sent, count - sent, 0);
+        if(status < 0) {
+            handle_error("sendmmsg()");
+        }
+        sent += status;
+    }
+    free(msgs);
+    messages_sent += count;
+    return count;
+}
+
+long long getMonotonicTimeMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void enableTimeout(int sock) {
-	setTimeout(sock, 120);
+long long getMonotonicTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void disableTimeout(int sock) {
-	setTimeout(sock, 0);
+int getClientIndex(struct sockaddr* addr) {
+    for(int i = 0; i < num_clients; i++) {
+        if(((struct sockaddr_in*)client_addrs[i])->sin_port == ((struct sockaddr_in*)addr)->sin_port) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 struct sockaddr_in* get_new_sockaddr() {
@@ -161,31 +408,790 @@ struct sockaddr_in* create_sockaddr(int port) {
 	return addr;
 }
 
-int waitForVotes(int sock) {
-    int count_vote_commit = 0;
-    int count_vote_abort = 0;
-    int clients = num_clients;
+// Thousands of in-flight transactions arrive as bursts far larger than the
+// default UDP receive buffer.
+void enableLargeBuffers(int sock) {
+    int size = SOCKET_BUFFER_SIZE;
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) < 0) {
+        handle_error("setsockopt()");
+    }
+}
+
+struct Transaction** getBucket(struct TransactionTable* table, int txn) {
+    return &table->buckets[(unsigned int)txn % TXN_TABLE_SIZE];
+}
+
+struct Transaction* findTransaction(struct TransactionTable* table, int txn) {
+    struct Transaction* t = *getBucket(table, txn);
+    while(t != NULL && t->txn != txn) {
+        t = t->next;
+    }
+    return t;
+}
+
+struct Transaction* createTransaction(struct TransactionTable* table, int txn) {
+    struct Transaction* t = (struct Transaction*)calloc(1, sizeof(struct Transaction));
+    t->txn = txn;
+    t->state = INIT;
+    t->voted = (char*)calloc(num_clients, sizeof(char));
+    t->started = getMonotonicTimeUs();
+    t->deadline = getMonotonicTimeMs() + vote_timeout_ms;
+    struct Transaction** bucket = getBucket(table, txn);
+    t->next = *bucket;
+    *bucket = t;
+    if(table->newest == NULL) {
+        table->oldest = t;
+    } else {
+        table->newest->next_deadline = t;
+    }
+    table->newest = t;
+    table->inflight++;
+    return t;
+}
+
+void unlinkTransaction(struct TransactionTable* table, struct Transaction* t) {
+    struct Transaction** link = getBucket(table, t->txn);
+    while(*link != t) {
+        link = &(*link)->next;
+    }
+    *link = t->next;
+    table->inflight--;
+}
+
+struct Decision* findDecision(struct TransactionTable* table, int txn) {
+    struct Decision* d = table->decisions[(unsigned int)txn % TXN_TABLE_SIZE];
+    while(d != NULL && d->txn != txn) {
+        d = d->next;
+    }
+    return d;
+}
+
+struct Decision* recordDecision(struct TransactionTable* table, int txn, enum MSG_TYPE decision) {
+    struct Decision** bucket = &table->decisions[(unsigned int)txn % TXN_TABLE_SIZE];
+    struct Decision* d = (struct Decision*)calloc(1, sizeof(struct Decision));
+    d->txn = txn;
+    d->decision = decision;
+    d->next = *bucket;
+    *bucket = d;
+    return d;
+}
+
+void forgetDecision(struct TransactionTable* table, struct Decision* d) {
+    struct Decision** link = &table->decisions[(unsigned int)d->txn % TXN_TABLE_SIZE];
+    while(*link != d) {
+        link = &(*link)->next;
+    }
+    *link = d->next;
+    free(d->prepared);
+    free(d);
+}
+
+void queueDecision(struct TransactionTable* table, struct Decision* d) {
+    if(table->num_outbox == table->outbox_capacity) {
+        table->outbox_capacity = table->outbox_capacity ? table->outbox_capacity << 1 : 1024;
+        table->outbox = (struct Decision**)realloc(table->outbox, sizeof(struct Decision*) * table->outbox_capacity);
+    }
+    table->outbox[table->num_outbox++] = d;
+}
+
+// Group commit: one fdatasync covers every commit taken since the last
+// flush, and only then do those commits go out, to prepared participants only.
+void flushDecisions(int sock, struct TransactionTable* table) {
+    if(table->num_outbox == 0) {
+        return;
+    }
+    txlogFlush(table->log);
+    for(int i = 0; i < table->num_outbox; i++) {
+        struct Decision* d = table->outbox[i];
+        d->durable = 1;
+        LOG(d->decision);
+        table->phase_two_messages += multicastVoteMessage(sock, d->txn, d->decision, d->prepared);
+        if(d->reply_parent) {
+            sendToParent(sock, d->txn, VOTE_COMMIT);
+            d->reply_parent = 0;
+        }
+    }
+    table->num_outbox = 0;
+}
+
+// With a single participant there is nothing to agree on: it decides and
+// logs the outcome itself, and the coordinator only relays it.
+void beginTransaction(int sock, struct TransactionTable* table, int txn) {
+    LOG(START_2PC);
+    struct Transaction* t = createTransaction(table, txn);
+    if(one_phase) {
+        LOG(COMMIT_REQUEST);
+        t->state = COMMIT_REQUEST;
+        multicastVoteMessage(sock, txn, COMMIT_REQUEST, NULL);
+    } else {
+        t->state = VOTE_REQUEST;
+        multicastVoteMessage(sock, txn, VOTE_REQUEST, NULL);
+    }
+}
+
+// Decided transactions leave the hash table straight away but stay on the
+// deadline FIFO until they reach its head, where they are freed.
+// A sub-coordinator's transaction may already have left the FIFO while it
+// waited for its parent, in which case nothing else will free it.
+void finishTransaction(struct TransactionTable* table, struct Transaction* t, enum MSG_TYPE decision) {
+    t->state = decision;
+    unlinkTransaction(table, t);
+    if(decision == INIT) {
+        table->failed++;
+    } else if(decision == GLOBAL_COMMIT) {
+        table->committed++;
+    } else {
+        table->aborted++;
+    }
+    if(decision != INIT && table->latency != NULL) {
+        table->latency[table->num_latency++] = getMonotonicTimeUs() - t->started;
+    }
+    if(t->off_fifo) {
+        freeTransaction(t);
+    }
+}
+
+void sendToParent(int sock, int txn, enum MSG_TYPE msg) {
+    struct VoteMessage vote;
+    vote.flags = 0;
+    vote.txn = txn;
+    vote.msg = msg;
+    consoleLogSend(msg, txn, (struct sockaddr*)&parent_addr);
+    if(sendto(sock, &vote, VOTE_LEN, 0, (struct sockaddr*)&parent_addr, sizeof(struct sockaddr)) < 0) {
+        handle_error("sendto()");
+    }
+    messages_sent++;
+}
+
+// Marks every participant whose vote satisfies want, or all but those whose
+// vote matches skip when want is 0.
+char* selectParticipants(struct Transaction* t, enum MSG_TYPE want) {
+    char* recipients = (char*)calloc(num_clients, sizeof(char));
+    for(int i = 0; i < num_clients; i++) {
+        if(want != 0) {
+            recipients[i] = (t->voted[i] == (char)want);
+        } else {
+            recipients[i] = (t->voted[i] != VOTE_ABORT && t->voted[i] != VOTE_READONLY);
+        }
+    }
+    return recipients;
+}
+
+// Three-phase commit: nobody commits until every prepared participant knows
+// that everyone voted commit, so survivors can finish without us.
+void preCommitTransaction(struct TransactionTable* table, struct Transaction* t) {
+    struct Decision* d = recordDecision(table, t->txn, PRE_COMMIT);
+    d->prepared = selectParticipants(t, VOTE_COMMIT);
+    txlogAppend(table->log, t->txn, PRE_COMMIT);
+    queueDecision(table, d);
+    t->state = PRE_COMMIT;
+}
+
+void commitPreCommitted(struct TransactionTable* table, struct Transaction* t) {
+    struct Decision* d = findDecision(table, t->txn);
+    d->decision = GLOBAL_COMMIT;
+    d->durable = 0;
+    d->pending_acks = t->count_prepared;
+    txlogAppend(table->log, t->txn, GLOBAL_COMMIT);
+    queueDecision(table, d);
+    finishTransaction(table, t, GLOBAL_COMMIT);
+}
+
+// Participants that suspected us may have elected a backup that settled a
+// pre-committed transaction without us. Its outcome is final, so we adopt
+// it: a commit is logged and sent like our own, an abort is presumed.
+void adoptBackupDecision(int sock, struct TransactionTable* table, struct Transaction* t, enum MSG_TYPE decision) {
+    if(verbose) {
+        printf("[LOG] Transaction %d was settled as %s by a backup coordinator\n", t->txn, getMessageTag(decision));
+    }
+    if(decision == GLOBAL_COMMIT) {
+        commitPreCommitted(table, t);
+        return;
+    }
+    forgetDecision(table, findDecision(table, t->txn));
+    char* recipients = selectParticipants(t, 0);
+    LOG(GLOBAL_ABORT);
+    table->phase_two_messages += multicastVoteMessage(sock, t->txn, GLOBAL_ABORT, recipients);
+    free(recipients);
+    finishTransaction(table, t, GLOBAL_ABORT);
+}
+
+// A pre-committed transaction only commits once every prepared participant
+// has acknowledged PRE_COMMIT, since a backup may have decided it already.
+// At its deadline PRE_COMMIT goes out again to those still missing. If one
+// of them is suspected we cannot tell what a backup decided, so we leave
+// the transaction to the participants as if we had crashed. Returns 1 if
+// the transaction is still waiting.
+int awaitPreCommitAcks(int sock, struct TransactionTable* table, struct Transaction* t) {
+    char* recipients = selectParticipants(t, VOTE_COMMIT);
+    int any_suspected = 0;
+    for(int i = 0; i < num_clients; i++) {
+        any_suspected |= recipients[i] && suspected[i];
+    }
+    if(any_suspected) {
+        if(verbose) {
+            printf("[LOG] A participant of pre-committed transaction %d is suspected, leaving it to the participants\n", t->txn);
+        }
+        free(recipients);
+        finishTransaction(table, t, INIT);
+        return 0;
+    }
+    multicastVoteMessage(sock, t->txn, PRE_COMMIT, recipients);
+    free(recipients);
+    return 1;
+}
+
+// Failure injection: we go down at the decision point, after the next
+// round reached only a random prefix of the prepared participants, and never
+// speak about the transaction again. The participants have to settle it.
+// The decision is still logged and synced before anything goes out, as a
+// real coordinator would have done, so a restarted one answers for it.
+void crashOnTransaction(int sock, struct TransactionTable* table, struct Transaction* t) {
+    enum MSG_TYPE decision = three_phase ? PRE_COMMIT : GLOBAL_COMMIT;
+    txlogAppend(table->log, t->txn, decision);
+    txlogFlush(table->log);
+    char* recipients = selectParticipants(t, VOTE_COMMIT);
+    int reached = rand() % (t->count_prepared + (three_phase ? 1 : 0));
+    for(int i = 0; i < num_clients; i++) {
+        if(recipients[i] && reached-- <= 0) {
+            recipients[i] = 0;
+        }
+    }
+    multicastVoteMessage(sock, t->txn, decision, recipients);
+    free(recipients);
+    recordDecision(table, t->txn, INIT);
+    finishTransaction(table, t, INIT);
+}
+
+// Presumed abort: an abort is neither logged nor acknowledged, and goes
+// straight out to everyone who has not already aborted or left as read-only.
+void decideTransaction(int sock, struct TransactionTable* table, struct Transaction* t, enum MSG_TYPE decision) {
+    if(sub_port && decision == GLOBAL_ABORT && t->state == VOTE_REQUEST) {
+        // our subtree cannot commit, so neither can the parent's transaction
+        sendToParent(sock, t->txn, VOTE_ABORT);
+    }
+    if(decision == GLOBAL_COMMIT && failure_percent > 0 && rand() % 100 < failure_percent) {
+        crashOnTransaction(sock, table, t);
+        return;
+    }
+    if(decision == GLOBAL_COMMIT && three_phase) {
+        preCommitTransaction(table, t);
+        return;
+    }
+    char* recipients = selectParticipants(t, (decision == GLOBAL_COMMIT) ? VOTE_COMMIT : 0);
+    if(decision == GLOBAL_COMMIT) {
+        struct Decision* d = recordDecision(table, t->txn, decision);
+        d->prepared = recipients;
+        d->pending_acks = t->count_prepared;
+        txlogAppend(table->log, t->txn, decision);
+        queueDecision(table, d);
+    } else {
+        LOG(decision);
+        table->phase_two_messages += multicastVoteMessage(sock, t->txn, decision, recipients);
+        free(recipients);
+    }
+    finishTransaction(table, t, decision);
+}
+
+enum MSG_TYPE getCommitDecision() {
+    if(!confirm_commit) {
+        return GLOBAL_COMMIT;
+    }
+    char vote_decision[8];
+    printf("All participants responded with VOTE_COMMIT.\nEnter COMMIT to proceed with voting or ABORT to abort: ");
+    if(scanf("%7s", vote_decision) == 1 && strcmp(vote_decision, "COMMIT") == 0) {
+        return GLOBAL_COMMIT;
+    }
+    return GLOBAL_ABORT;
+}
+
+// A transaction with no logged decision that is no longer in flight can
+// never have committed, since commit is always logged before it is sent.
+// Neither can we answer for a transaction left pre-committed or crashed on.
+// A sub-coordinator presumes nothing: only the root decides, so it passes
+// the question up and relays the answer when it comes back down, also for
+// a transaction whose vote it has already sent up.
+// A participant asking about a transaction we are pre-committing may have
+// missed PRE_COMMIT, so it gets PRE_COMMIT again. A commit still waiting
+// for the next group flush is in flight too: answering it before its
+// record is durable could contradict the abort a restart would presume.
+void answerDecisionRequest(int sock, struct TransactionTable* table, int txn, struct sockaddr* addr) {
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL) {
+        if(t->state == PRE_COMMIT) {
+            char* recipients = (char*)calloc(num_clients, sizeof(char));
+            int client = getClientIndex(addr);
+            if(client >= 0 && t->voted[client] == VOTE_COMMIT) {
+                recipients[client] = 1;
+                multicastVoteMessage(sock, txn, PRE_COMMIT, recipients);
+            }
+            free(recipients);
+        } else if(sub_port && t->state == VOTE_COMMIT) {
+            sendToParent(sock, txn, DECISION_REQUEST);
+        }
+        return;
+    }
+    struct Decision* d = findDecision(table, txn);
+    if(d == NULL && sub_port) {
+        sendToParent(sock, txn, DECISION_REQUEST);
+        return;
+    }
+    if(d != NULL && !d->durable) {
+        return;
+    }
+    enum MSG_TYPE decision = (d != NULL) ? d->decision : GLOBAL_ABORT;
+    if(decision != GLOBAL_COMMIT && decision != GLOBAL_ABORT) {
+        return;
+    }
+    LOG(DECISION_REQUEST);
+    consoleLogSend(decision, txn, addr);
     struct VoteMessage vote;
+    vote.flags = 0;
+    vote.txn = txn;
+    vote.msg = decision;
+    if(sendto(sock, &vote, VOTE_LEN, 0, addr, sizeof(struct sockaddr)) < 0) {
+        handle_error("sendto()");
+    }
+    messages_sent++;
+}
+
+// Once every prepared participant has acknowledged a commit nobody can ask
+// about it any more.
+void handleAck(int sock, struct TransactionTable* table, int txn, int client) {
+    struct Decision* d = findDecision(table, txn);
+    if(d == NULL || d->prepared == NULL || client < 0 || !d->prepared[client]) {
+        return;
+    }
+    d->prepared[client] = 0;
+    if(--d->pending_acks == 0) {
+        if(sub_port) {
+            sendToParent(sock, txn, ACK);
+        }
+        forgetDecision(table, d);
+    }
+}
+
+// Tree commit: to its parent a sub-coordinator is one more participant. It
+// runs the vote across its own children and answers with a single vote. A
+// parent whose only child we are sends a one-phase COMMIT_REQUEST instead,
+// and then we decide for the subtree and answer with the outcome.
+void beginSubTransaction(int sock, struct TransactionTable* table, int txn, struct sockaddr* addr, int delegated) {
+    memcpy(&parent_addr, addr, sizeof(struct sockaddr_in));
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL) {
+        if(t->state == VOTE_COMMIT) {
+            sendToParent(sock, txn, VOTE_COMMIT);
+        }
+        return;
+    }
+    if(findDecision(table, txn) != NULL) {
+        return;
+    }
+    LOG(START_2PC);
+    t = createTransaction(table, txn);
+    t->state = VOTE_REQUEST;
+    t->delegated = delegated;
+    multicastVoteMessage(sock, txn, VOTE_REQUEST, NULL);
+}
+
+// A delegated commit is ours to decide. The parent hears VOTE_COMMIT, which
+// to a one-phase coordinator means committed, only once our commit record
+// is durable.
+void voteUpward(int sock, struct TransactionTable* table, struct Transaction* t) {
+    if(t->count_prepared == 0) {
+        sendToParent(sock, t->txn, VOTE_READONLY);
+        finishTransaction(table, t, GLOBAL_COMMIT);
+    } else if(t->delegated) {
+        decideTransaction(sock, table, t, GLOBAL_COMMIT);
+        struct Decision* d = findDecision(table, t->txn);
+        if(d != NULL) {
+            d->reply_parent = 1;
+        }
+    } else {
+        sendToParent(sock, t->txn, VOTE_COMMIT);
+        t->state = VOTE_COMMIT;
+    }
+}
+
+// The parent's decision goes down to our prepared children. One for a
+// transaction we no longer hold answers a relayed DECISION_REQUEST and goes
+// to every child; a commit is logged first, like any other.
+void handleParentDecision(int sock, struct TransactionTable* table, int txn, enum MSG_TYPE decision) {
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL) {
+        if(decision == GLOBAL_ABORT || t->state == VOTE_COMMIT) {
+            decideTransaction(sock, table, t, decision);
+        }
+        return;
+    }
+    if(findDecision(table, txn) != NULL) {
+        return;
+    }
+    if(decision == GLOBAL_COMMIT) {
+        struct Decision* d = recordDecision(table, txn, decision);
+        d->prepared = (char*)malloc(num_clients);
+        memset(d->prepared, 1, num_clients);
+        d->pending_acks = num_clients;
+        txlogAppend(table->log, txn, decision);
+        queueDecision(table, d);
+    } else {
+        LOG(decision);
+        multicastVoteMessage(sock, txn, decision, NULL);
+    }
+}
+
+// A one-phase participant answers with the outcome it has already logged.
+void handleOnePhaseOutcome(struct TransactionTable* table, struct Transaction* t, enum MSG_TYPE vote) {
+    finishTransaction(table, t, (vote == VOTE_ABORT) ? GLOBAL_ABORT : GLOBAL_COMMIT);
+}
+
+void handleVote(int sock, struct TransactionTable* table, struct VoteMessage* vote, struct sockaddr* addr) {
+    int client = getClientIndex(addr);
+    if(vote->msg == HEARTBEAT) {
+        if(client >= 0) {
+            fdHeartbeat(&detectors[client], getMonotonicTimeUs());
+        } else if(sub_port) {
+            // only the parent heartbeats us without being one of our participants
+            memcpy(&parent_addr, addr, sizeof(struct sockaddr_in));
+        }
+        return;
+    }
+    consoleLogReceive(vote->msg, vote->txn, addr);
+    if(vote->msg == DECISION_REQUEST) {
+        answerDecisionRequest(sock, table, vote->txn, addr);
+        return;
+    } else if(vote->msg == ACK) {
+        handleAck(sock, table, vote->txn, client);
+        return;
+    } else if(sub_port && (vote->msg == VOTE_REQUEST || vote->msg == COMMIT_REQUEST)) {
+        beginSubTransaction(sock, table, vote->txn, addr, vote->msg == COMMIT_REQUEST);
+        return;
+    } else if(sub_port && (vote->msg == GLOBAL_COMMIT || vote->msg == GLOBAL_ABORT)) {
+        handleParentDecision(sock, table, vote->txn, vote->msg);
+        return;
+    }
+    struct Transaction* t = findTransaction(table, vote->txn);
+    if(t != NULL && t->state == PRE_COMMIT && vote->msg == PRE_COMMIT_ACK && client >= 0 && t->voted[client] == VOTE_COMMIT) {
+        t->voted[client] = PRE_COMMIT_ACK;
+        if(++t->count_pre_commit_acks == t->count_prepared) {
+            commitPreCommitted(table, t);
+        }
+        return;
+    }
+    if(t != NULL && t->state == PRE_COMMIT && client >= 0 && (vote->msg == GLOBAL_COMMIT || vote->msg == GLOBAL_ABORT)) {
+        adoptBackupDecision(sock, table, t, vote->msg);
+        return;
+    }
+    if(t == NULL || client < 0 || t->voted[client]) {
+        return;
+    }
+    if(t->state == COMMIT_REQUEST) {
+        handleOnePhaseOutcome(table, t, vote->msg);
+        return;
+    } else if(t->state != VOTE_REQUEST) {
+        return;
+    }
+    t->voted[client] = vote->msg;
+    if(vote->msg == VOTE_ABORT) {
+        decideTransaction(sock, table, t, GLOBAL_ABORT);
+        return;
+    }
+    if(vote->msg == VOTE_COMMIT) {
+        t->count_prepared++;
+    }
+    if(++t->count_votes < num_clients) {
+        return;
+    }
+    if(sub_port) {
+        voteUpward(sock, table, t);
+    } else if(t->count_prepared == 0) {
+        // read-only everywhere: nothing to log and no phase two
+        LOG(VOTE_READONLY);
+        finishTransaction(table, t, GLOBAL_COMMIT);
+    } else {
+        decideTransaction(sock, table, t, getCommitDecision());
+    }
+}
+
+void freeTransaction(struct Transaction* t) {
+    free(t->voted);
+    free(t);
+}
+
+// Drops decided transactions off the FIFO head and aborts any whose vote
+// deadline has passed. A pre-committed one still missing acks goes back to
+// the tail with a fresh deadline. Returns the poll timeout until the next
+// deadline.
+int expireTransactions(int sock, struct TransactionTable* table) {
+    long long now = getMonotonicTimeMs();
+    while(table->oldest != NULL) {
+        struct Transaction* t = table->oldest;
+        int undecided = (t->state == VOTE_REQUEST || t->state == COMMIT_REQUEST || t->state == PRE_COMMIT);
+        if(undecided && t->deadline > now) {
+            return (int)(t->deadline - now);
+        }
+        if(t->state == VOTE_COMMIT) {
+            // a sub-coordinator's vote is in; the parent decides when, and
+            // is asked once in case its decision was lost on the way down
+            t->off_fifo = 1;
+            sendToParent(sock, t->txn, DECISION_REQUEST);
+        } else if(t->state == PRE_COMMIT) {
+            if(awaitPreCommitAcks(sock, table, t)) {
+                table->oldest = t->next_deadline;
+                t->next_deadline = NULL;
+                t->deadline = now + vote_timeout_ms;
+                if(table->oldest == NULL) {
+                    table->oldest = t;
+                } else {
+                    table->newest->next_deadline = t;
+                }
+                table->newest = t;
+                continue;
+            }
+        } else if(undecided) {
+            if(verbose) {
+                printf("[LOG] Vote deadline expired for transaction %d with %d of %d votes\n", t->txn, t->count_votes, num_clients);
+            }
+            decideTransaction(sock, table, t, GLOBAL_ABORT);
+        }
+        table->oldest = t->next_deadline;
+        if(table->oldest == NULL) {
+            table->newest = NULL;
+        }
+        if(!t->off_fifo) {
+            freeTransaction(t);
+        }
+    }
+    return -1;
+}
+
+// Heartbeats go to every participant, and from a sub-coordinator to its
+// parent as well once it has heard from it, whatever else is being sent.
+long long sendHeartbeats(int sock, long long next_heartbeat) {
+    long long now = getMonotonicTimeMs();
+    if(now < next_heartbeat) {
+        return next_heartbeat;
+    }
+    multicastVoteMessage(sock, 0, HEARTBEAT, NULL);
+    if(sub_port && parent_addr.sin_family == AF_INET) {
+        sendToParent(sock, 0, HEARTBEAT);
+    }
+    return now + FD_HEARTBEAT_INTERVAL_MS;
+}
+
+// Aborts every transaction still waiting for the vote of a participant the
+// failure detector suspects, long before its vote deadline would. A
+// suspected participant that heartbeats again is trusted again.
+void abortSuspected(int sock, struct TransactionTable* table) {
+    long long now = getMonotonicTimeUs();
+    int any = 0;
+    for(int i = 0; i < num_clients; i++) {
+        int suspect = fdSuspect(&detectors[i], now);
+        if(suspect != suspected[i] && verbose) {
+            printf("[LOG] %s client %d (phi=%.1f)\n", suspect ? "Suspecting" : "Trusting", participant_ports[i],
+                    fdPhi(&detectors[i], now));
+        }
+        suspected[i] = suspect;
+        any |= suspect;
+    }
+    if(!any) {
+        return;
+    }
+    for(struct Transaction* t = table->oldest; t != NULL; t = t->next_deadline) {
+        if(t->state != VOTE_REQUEST) {
+            continue;
+        }
+        for(int i = 0; i < num_clients; i++) {
+            if(suspected[i] && !t->voted[i]) {
+                if(verbose) {
+                    printf("[LOG] Aborting transaction %d, client %d is suspected\n", t->txn, participant_ports[i]);
+                }
+                decideTransaction(sock, table, t, GLOBAL_ABORT);
+                break;
+            }
+        }
+    }
+}
+
+// Waits no longer than the next heartbeat is due.
+int getPollTimeout(int timeout, long long next_heartbeat) {
+    long long until_heartbeat = next_heartbeat - getMonotonicTimeMs();
+    if(until_heartbeat < 0) {
+        until_heartbeat = 0;
+    }
+    if(timeout < 0 || until_heartbeat < timeout) {
+        return (int)until_heartbeat;
+    }
+    return timeout;
+}
+
+// A batch is only trusted as far as the datagram that carried it reaches.
+int isValidBatch(struct BatchHeader* header, int len) {
+    if(header->count < 0 || header->count > MAX_BATCH || header->num_participants < 0 || header->num_participants > MAX_PARTICIPANTS) {
+        return 0;
+    }
+    return len >= (int)(sizeof(struct BatchHeader) + sizeof(int) * header->num_participants + VOTE_LEN * header->count);
+}
+
+void receiveVotes(int sock, struct TransactionTable* table) {
+    char buffer[BATCH_BUFFER_LEN];
     struct sockaddr addr;
-    while(clients--) {
-        waitForVote(sock, &vote, &addr, DIE);
-        consoleLogReceive(vote.msg, &addr);
-        if(vote.msg == VOTE_COMMIT) {
-            count_vote_commit++;
-        } else if(vote.msg == VOTE_ABORT) {
-            count_vote_abort++;
+    for(;;) {
+        int len = getClientVote(sock, buffer, &addr);
+        if(len < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            handle_error("recvfrom()");
+        }
+        struct BatchHeader* header = (struct BatchHeader*)buffer;
+        if(!(header->flags & BATCH)) {
+            handleVote(sock, table, (struct VoteMessage*)buffer, &addr);
+            continue;
+        }
+        if(!isValidBatch(header, len)) {
+            continue;
+        }
+        struct VoteMessage* votes = (struct VoteMessage*)(buffer + sizeof(struct BatchHeader) + sizeof(int) * header->num_participants);
+        for(int i = 0; i < header->count; i++) {
+            handleVote(sock, table, &votes[i], &addr);
+        }
+    }
+}
+
+int compareLatency(const void* a, const void* b) {
+    long long x = *(long long*)a, y = *(long long*)b;
+    return (x > y) - (x < y);
+}
+
+void stopCoordinator(int signum) {
+    (void)signum;
+    running = 0;
+}
+
+// Serves VOTE_REQUESTs from a parent coordinator until interrupted.
+void runSubCoordinator(int sock, struct TransactionTable* table) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = stopCoordinator;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    long long next_heartbeat = 0;
+    while(running) {
+        long long last_heartbeat = next_heartbeat;
+        next_heartbeat = sendHeartbeats(sock, next_heartbeat);
+        if(next_heartbeat != last_heartbeat) {
+            abortSuspected(sock, table);
         }
+        int timeout = expireTransactions(sock, table);
+        flushDecisions(sock, table);
+        flushBatches(sock);
+        if(poll(&pfd, 1, getPollTimeout(timeout, next_heartbeat)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            handle_error("poll()");
+        }
+        receiveVotes(sock, table);
     }
-    assert(count_vote_commit + count_vote_abort == num_clients);
-    return count_vote_commit - num_clients;
+    printf("Relayed %d commits and %d aborts, sent %lld messages, logged %lld records with %lld fsyncs\n", table->committed,
+            table->aborted, messages_sent, table->log->num_records, table->log->num_syncs);
 }
 
+// Rebuilds the decision table from the log and returns the first transaction id
+// past every id a previous run reserved, decided or not.
+int recoverDecisions(struct TransactionTable* table, const char* log_path) {
+    int num_records;
+    struct LogRecord* records = txlogRead(log_path, &num_records);
+    int max_txn = 0;
+    for(int i = 0; i < num_records; i++) {
+        if(records[i].type != START_2PC) {
+            recordDecision(table, records[i].txn, records[i].type)->durable = 1;
+        }
+        if(records[i].txn > max_txn) {
+            max_txn = records[i].txn;
+        }
+    }
+    free(records);
+    if(num_records > 0) {
+        printf("Recovered %d log records from %s\n", num_records, log_path);
+        return max_txn + 1;
+    }
+    return 1;
+}
+
+// ./coordinator [-n NUM_TXNS] [-w WINDOW] [-t TIMEOUT_MS] [-l LOG_PATH] [-3] [-f FAILURE_PERCENT] [-s PORT] [-b BATCH_SIZE] [-q] p1 p2 ... pn
+// Up to WINDOW transactions are in flight at once; a single transaction asks for confirmation before committing.
+// A participant the heartbeat failure detector suspects gets its undecided transactions aborted at once;
+// TIMEOUT_MS only bounds how long a live but slow participant may take to vote.
+// -3 runs three-phase commit; -f makes the coordinator drop out of that share of commits at the decision point.
+// -b BATCH_SIZE packs up to that many transactions' messages for one participant into each datagram.
+// -s PORT runs a sub-coordinator on PORT for a tree commit: list it as a participant of the coordinator above,
+// and it relays each vote to its own participants p1 ... pn, which may be sub-coordinators in turn.
 int main(int argc, char **argv) {
-    num_clients = (argc > 1) ? argc - 1 : 0;
+    int num_txns = 1;
+    int window = DEFAULT_WINDOW;
+    char* log_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "n:w:t:l:3f:s:b:q")) != -1) {
+        if(opt == 'l') {
+            log_path = optarg;
+        } else if(opt == 'n') {
+            num_txns = atoi(optarg);
+        } else if(opt == 'w') {
+            window = atoi(optarg);
+        } else if(opt == 't') {
+            vote_timeout_ms = atoi(optarg);
+        } else if(opt == '3') {
+            three_phase = 1;
+        } else if(opt == 'f') {
+            failure_percent = atoi(optarg);
+        } else if(opt == 'b') {
+            batch_size = atoi(optarg);
+        } else if(opt == 's') {
+            sub_port = atoi(optarg);
+        } else if(opt == 'q') {
+            verbose = 0;
+        } else {
+            exit(EXIT_FAILURE);
+        }
+    }
+    confirm_commit = (num_txns == 1) && !sub_port;
+    if(sub_port && three_phase) {
+        fprintf(stderr, "Three-phase commit does not run through sub-coordinators\n");
+        exit(EXIT_FAILURE);
+    }
+    char sub_log_path[64];
+    if(log_path == NULL && sub_port) {
+        sprintf(sub_log_path, SUB_LOG_PATH_FORMAT, sub_port);
+        log_path = sub_log_path;
+    } else if(log_path == NULL) {
+        log_path = LOG_PATH;
+    }
+
+    num_clients = argc - optind;
+    if(num_clients > MAX_PARTICIPANTS) {
+        fprintf(stderr, "At most %d participants are supported\n", MAX_PARTICIPANTS);
+        exit(EXIT_FAILURE);
+    }
+    one_phase = (num_clients == 1) && !sub_port;
+    if(batch_size < 0 || batch_size > MAX_BATCH) {
+        fprintf(stderr, "Batches hold at most %d messages\n", MAX_BATCH);
+        exit(EXIT_FAILURE);
+    }
     client_addrs = (struct sockaddr**)malloc(sizeof(struct sockaddr*) * num_clients);
+    participant_ports = (int*)malloc(sizeof(int) * num_clients);
+    batches = (struct Batch*)calloc(num_clients, sizeof(struct Batch));
+    detectors = (struct FailureDetector*)calloc(num_clients, sizeof(struct FailureDetector));
+    suspected = (char*)calloc(num_clients, sizeof(char));
     for(int i = 0; i < num_clients; i++) {
-        int port = atoi(argv[i+1]);
+        int port = atoi(argv[optind + i]);
 		client_addrs[i] = (struct sockaddr*)create_sockaddr(port);
+        participant_ports[i] = port;
+        batches[i].header.flags = BATCH;
     }
 
 	int sock;
@@ -194,44 +1200,82 @@ int main(int argc, char **argv) {
 	}
 
 	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(struct sockaddr);
 	memset(&addr, 0, sizeof(struct sockaddr_in));
 	addr.sin_family = AF_INET;
-	addr.sin_port = PORT;
+	addr.sin_port = sub_port ? sub_port : PORT;
 	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	printf("Attempting to start daemon on port %d\n", PORT);
+	printf("Attempting to start daemon on port %d\n", addr.sin_port);
 
 	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
 		handle_error("bind()");
 	}
 
-	enableTimeout(sock);
-
-	struct VoteMessage vote;
-	do {
-		LOG(START_2PC);
-
-        multicastVoteMessage(sock, VOTE_REQUEST);
-
-        int status = waitForVotes(sock);
+    enableLargeBuffers(sock);
 
-        char* vote_decision = (char*)malloc(sizeof(char) * 8);
-        if(status == 0) {
-            printf("All participants responded with VOTE_COMMIT.\nEnter COMMIT to proceed with voting or ABORT to abort: ");
-            scanf("%s", vote_decision);
+    srand(time(NULL));
+    struct TransactionTable* table = (struct TransactionTable*)calloc(1, sizeof(struct TransactionTable));
+    int first_txn = recoverDecisions(table, log_path);
+    table->log = txlogOpen(log_path);
+    if(sub_port) {
+        runSubCoordinator(sock, table);
+        txlogClose(table->log);
+        free(table);
+        close(sock);
+        return 0;
+    }
+    table->latency = (long long*)malloc(sizeof(long long) * num_txns);
+    // reserve this run's transaction ids so a restart never reuses one a participant may hold in doubt
+    txlogAppend(table->log, first_txn + num_txns - 1, START_2PC);
+    txlogFlush(table->log);
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    int next_txn = first_txn;
+    long long start = getMonotonicTimeMs();
+    long long next_heartbeat = 0;
+    for(;;) {
+        long long last_heartbeat = next_heartbeat;
+        next_heartbeat = sendHeartbeats(sock, next_heartbeat);
+        if(next_heartbeat != last_heartbeat) {
+            abortSuspected(sock, table);
         }
-
-        if(status == 0 && strcmp(vote_decision, "COMMIT") == 0) {
-            LOG(GLOBAL_COMMIT);
-            multicastVoteMessage(sock, GLOBAL_COMMIT);
-        } else {
-            LOG(GLOBAL_ABORT);
-            multicastVoteMessage(sock, GLOBAL_ABORT);
+        while(table->inflight < window && next_txn < first_txn + num_txns) {
+            beginTransaction(sock, table, next_txn++);
+        }
+        int timeout = expireTransactions(sock, table);
+        flushDecisions(sock, table);
+        flushBatches(sock);
+        if(table->committed + table->aborted + table->failed == num_txns) {
+            break;
         }
-	} while(0);
+        if(poll(&pfd, 1, getPollTimeout(timeout, next_heartbeat)) < 0) {
+            handle_error("poll()");
+        }
+        receiveVotes(sock, table);
+    }
+    long long elapsed = getMonotonicTimeMs() - start;
 
+    printf("Committed %d and aborted %d transactions in %lld ms", table->committed, table->aborted, elapsed);
+    if(elapsed > 0) {
+        printf(" (%.1f transactions/s)", num_txns * 1000.0 / elapsed);
+    }
+    printf("\n");
+    if(table->failed > 0) {
+        printf("Crashed on %d transactions, left to the participants\n", table->failed);
+    }
+    if(table->num_latency > 0) {
+        qsort(table->latency, table->num_latency, sizeof(long long), compareLatency);
+        printf("Decision latency p50=%.2f ms p99=%.2f ms\n", table->latency[table->num_latency / 2] / 1000.0,
+                table->latency[(table->num_latency * 99) / 100] / 1000.0);
+    }
+    printf("Sent %lld datagrams (%lld phase-two messages), logged %lld records with %lld fsyncs\n", messages_sent,
+            table->phase_two_messages, table->log->num_records, table->log->num_syncs);
+
+    txlogClose(table->log);
+    free(table->latency);
+    free(table);
 	close(sock);
 	
 	return 0;
-}
\ No newline at end of file
+}
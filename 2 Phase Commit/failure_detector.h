@@ -0,0 +1,72 @@
+#ifndef FAILURE_DETECTOR_H
+#define FAILURE_DETECTOR_H
+
+#include <math.h>
+
+// Phi-accrual failure detector shared by the coordinator and the participants
+// (link with -lm). Each side sends HEARTBEAT every FD_HEARTBEAT_INTERVAL_MS
+// and keeps, per peer, the mean and variance of the last FD_WINDOW heartbeat
+// inter-arrival times. phi is -log10 of the probability that a live peer's
+// next heartbeat would be this late under a normal fit of those intervals,
+// so the time to suspicion follows the jitter the link actually shows
+// instead of a fixed timeout. A peer we have too few samples for is never
+// suspected.
+
+#define FD_HEARTBEAT_INTERVAL_MS 20
+#define FD_WINDOW 128
+#define FD_MIN_SAMPLES 4
+#define FD_PHI_THRESHOLD 8.0
+
+struct FailureDetector {
+    long long last_arrival_us;
+    int count;
+    int next;
+    double sum;
+    double sum_sq;
+    double intervals[FD_WINDOW];
+};
+
+static inline void fdHeartbeat(struct FailureDetector* fd, long long now_us) {
+    if(fd->last_arrival_us > 0) {
+        double interval = (double)(now_us - fd->last_arrival_us);
+        if(fd->count == FD_WINDOW) {
+            double oldest = fd->intervals[fd->next];
+            fd->sum -= oldest;
+            fd->sum_sq -= oldest * oldest;
+        } else {
+            fd->count++;
+        }
+        fd->intervals[fd->next] = interval;
+        fd->next = (fd->next + 1) % FD_WINDOW;
+        fd->sum += interval;
+        fd->sum_sq += interval * interval;
+    }
+    fd->last_arrival_us = now_us;
+}
+
+// On a quiet link the intervals barely vary, so the deviation is floored at
+// a quarter of the mean; otherwise a heartbeat a millisecond late would look
+// like a crash.
+static inline double fdPhi(struct FailureDetector* fd, long long now_us) {
+    if(fd->count < FD_MIN_SAMPLES) {
+        return 0;
+    }
+    double mean = fd->sum / fd->count;
+    double variance = fd->sum_sq / fd->count - mean * mean;
+    double deviation = (variance > 0) ? sqrt(variance) : 0;
+    if(deviation < mean / 4) {
+        deviation = mean / 4;
+    }
+    double elapsed = (double)(now_us - fd->last_arrival_us);
+    double p_later = 0.5 * erfc((elapsed - mean) / (deviation * M_SQRT2));
+    if(p_later < 1e-300) {
+        return 300;
+    }
+    return -log10(p_later);
+}
+
+static inline int fdSuspect(struct FailureDetector* fd, long long now_us) {
+    return fdPhi(fd, now_us) > FD_PHI_THRESHOLD;
+}
+
+#endif
@@ -0,0 +1,161 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "kvstore.h"
+
+#define DEFAULT_TIMEOUT_MS 100
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, ACK, DECISION_REQUEST, VOTE_READONLY, COMMIT_REQUEST,
+    PRE_COMMIT, PRE_COMMIT_ACK, STATE_REPORT, KV_GET, KV_VALUE,
+    HEARTBEAT};
+
+struct KvMessage {
+    int flags;
+    int key;
+    enum MSG_TYPE msg;
+    long long snapshot;
+    int value;
+};
+
+long long getMonotonicTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int compareLatency(const void* a, const void* b) {
+    long long x = *(long long*)a, y = *(long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Waits for the KV_VALUE answering key from addr, dropping late answers to
+// reads that already timed out. Returns 0 if none came within timeout_ms.
+int awaitValue(int sock, int key, struct sockaddr_in* addr, long long deadline, struct KvMessage* reply) {
+    for(;;) {
+        long long now = getMonotonicTimeUs();
+        if(now >= deadline) {
+            return 0;
+        }
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if(poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) < 0) {
+            handle_error("poll()");
+        }
+        if(!(pfd.revents & POLLIN)) {
+            continue;
+        }
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(struct sockaddr_in);
+        int len = recvfrom(sock, reply, sizeof(struct KvMessage), 0, (struct sockaddr*)&from, &fromlen);
+        if(len < 0) {
+            handle_error("recvfrom()");
+        }
+        if(len == sizeof(struct KvMessage) && reply->msg == KV_VALUE && reply->key == key && from.sin_port == addr->sin_port) {
+            return 1;
+        }
+    }
+}
+
+// ./kv_reader [-n NUM_READS] [-k KEY_SPACE] [-l SNAPSHOT_LAG] [-t TIMEOUT_MS] p1 p2 ... pn
+// Reads random keys from participants started with the KV policy, one KV_GET at a time and round-robin across them,
+// while transactions commit on them. Without -l every read asks for the newest commit; with it a read asks for the
+// snapshot SNAPSHOT_LAG commits behind the newest one seen from that shard, so a lag past what the shard keeps shows
+// up as snapshots too old to read.
+int main(int argc, char **argv) {
+    int num_reads = 10000;
+    int key_space = 1<<20;
+    long long snapshot_lag = 0;
+    int timeout_ms = DEFAULT_TIMEOUT_MS;
+    int opt;
+    while((opt = getopt(argc, argv, "n:k:l:t:")) != -1) {
+        if(opt == 'n') {
+            num_reads = atoi(optarg);
+        } else if(opt == 'k') {
+            key_space = atoi(optarg);
+        } else if(opt == 'l') {
+            snapshot_lag = atoll(optarg);
+        } else if(opt == 't') {
+            timeout_ms = atoi(optarg);
+        } else {
+            exit(EXIT_FAILURE);
+        }
+    }
+    int num_shards = argc - optind;
+    if(num_shards <= 0 || num_reads <= 0 || key_space <= 0) {
+        fprintf(stderr, "Usage: %s [-n NUM_READS] [-k KEY_SPACE] [-l SNAPSHOT_LAG] [-t TIMEOUT_MS] p1 ... pn\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in* shard_addrs = (struct sockaddr_in*)calloc(num_shards, sizeof(struct sockaddr_in));
+    for(int i = 0; i < num_shards; i++) {
+        shard_addrs[i].sin_family = AF_INET;
+        shard_addrs[i].sin_port = atoi(argv[optind + i]);
+        shard_addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+
+    int sock;
+    if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        handle_error("socket()");
+    }
+
+    srand(time(NULL));
+    // the newest commit timestamp each shard has answered with so far
+    long long* newest = (long long*)calloc(num_shards, sizeof(long long));
+    long long* latency = (long long*)malloc(sizeof(long long) * num_reads);
+    int num_answered = 0, num_found = 0, num_missing = 0, num_too_old = 0;
+    long long start = getMonotonicTimeUs();
+    for(int r = 0; r < num_reads; r++) {
+        int shard = r % num_shards;
+        struct KvMessage request;
+        memset(&request, 0, sizeof(struct KvMessage));
+        request.key = rand() % key_space;
+        request.msg = KV_GET;
+        request.snapshot = (snapshot_lag > 0 && newest[shard] > snapshot_lag) ? newest[shard] - snapshot_lag : 0;
+        long long sent = getMonotonicTimeUs();
+        if(sendto(sock, &request, sizeof(struct KvMessage), 0, (struct sockaddr*)&shard_addrs[shard], sizeof(struct sockaddr)) < 0) {
+            handle_error("sendto(KV_GET)");
+        }
+
+        struct KvMessage reply;
+        if(!awaitValue(sock, request.key, &shard_addrs[shard], sent + timeout_ms * 1000LL, &reply)) {
+            continue;
+        }
+        latency[num_answered++] = getMonotonicTimeUs() - sent;
+        if(reply.snapshot == KV_TOO_OLD) {
+            num_too_old++;
+        } else if(reply.snapshot == 0) {
+            num_missing++;
+        } else {
+            num_found++;
+            if(reply.snapshot > newest[shard]) {
+                newest[shard] = reply.snapshot;
+            }
+        }
+    }
+    double elapsed_ms = (getMonotonicTimeUs() - start) / 1000.0;
+
+    printf("%d of %d reads answered in %.0f ms (%.1f reads/s): %d found, %d missing, %d snapshots too old\n", num_answered,
+            num_reads, elapsed_ms, num_answered * 1000.0 / elapsed_ms, num_found, num_missing, num_too_old);
+    if(num_answered > 0) {
+        qsort(latency, num_answered, sizeof(long long), compareLatency);
+        printf("Read latency p50=%.1f us p99=%.1f us\n", (double)latency[num_answered / 2],
+                (double)latency[(num_answered * 99) / 100]);
+    }
+
+    free(latency);
+    free(newest);
+    free(shard_addrs);
+    close(sock);
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include <stdlib.h>
+
+// In-memory multiversion key-value shard hosted by a 2PC participant.
+// A commit never overwrites a value: it pushes a new version stamped with the
+// shard's commit clock, so a read at any snapshot finds its version without
+// looking at, let alone waiting for, a prepared writer. A prepared
+// transaction instead holds a write intent on every key it will change; a
+// second writer that finds the intent loses at once, since a participant
+// cannot hold back its vote to wait for the first one's decision.
+
+#define KV_TABLE_SIZE (1<<16)
+#define KV_MAX_VERSIONS 8
+#define KV_NO_INTENT (-1)
+#define KV_TOO_OLD (-1)
+
+struct KvVersion {
+    long long commit_ts;
+    int value;
+    struct KvVersion* older;
+};
+
+struct KvEntry {
+    int key;
+    int intent_txn;
+    int intent_value;
+    long long first_commit_ts;
+    struct KvVersion* newest;
+    struct KvEntry* next;
+};
+
+struct KvStore {
+    struct KvEntry* buckets[KV_TABLE_SIZE];
+    long long clock;
+    int num_keys;
+    long long num_versions;
+    long long num_conflicts;
+    long long num_reads;
+    long long num_too_old;
+};
+
+static inline struct KvEntry* kvFind(struct KvStore* store, int key, int create) {
+    struct KvEntry** bucket = &store->buckets[(unsigned int)key % KV_TABLE_SIZE];
+    struct KvEntry* e = *bucket;
+    while(e != NULL && e->key != key) {
+        e = e->next;
+    }
+    if(e == NULL && create) {
+        e = (struct KvEntry*)calloc(1, sizeof(struct KvEntry));
+        e->key = key;
+        e->intent_txn = KV_NO_INTENT;
+        e->next = *bucket;
+        *bucket = e;
+        store->num_keys++;
+    }
+    return e;
+}
+
+// Places txn's write intent on key. Returns 0 if another transaction holds
+// it; restaging a key txn already holds just replaces the value.
+static inline int kvStage(struct KvStore* store, int txn, int key, int value) {
+    struct KvEntry* e = kvFind(store, key, 1);
+    if(e->intent_txn != KV_NO_INTENT && e->intent_txn != txn) {
+        store->num_conflicts++;
+        return 0;
+    }
+    e->intent_txn = txn;
+    e->intent_value = value;
+    return 1;
+}
+
+static inline void kvDiscard(struct KvStore* store, int txn, int key) {
+    struct KvEntry* e = kvFind(store, key, 0);
+    if(e != NULL && e->intent_txn == txn) {
+        e->intent_txn = KV_NO_INTENT;
+    }
+}
+
+// Every key of one transaction is installed under the same timestamp.
+static inline long long kvNextTimestamp(struct KvStore* store) {
+    return ++store->clock;
+}
+
+// Turns txn's intent on key into the newest version, dropping versions past
+// KV_MAX_VERSIONS; snapshots older than those can no longer be read. The
+// key's first commit is remembered to tell those apart from snapshots
+// taken before the key existed.
+static inline void kvInstall(struct KvStore* store, int txn, int key, long long commit_ts) {
+    struct KvEntry* e = kvFind(store, key, 0);
+    if(e == NULL || e->intent_txn != txn) {
+        return;
+    }
+    struct KvVersion* v = (struct KvVersion*)malloc(sizeof(struct KvVersion));
+    v->commit_ts = commit_ts;
+    v->value = e->intent_value;
+    v->older = e->newest;
+    e->newest = v;
+    if(e->first_commit_ts == 0) {
+        e->first_commit_ts = commit_ts;
+    }
+    e->intent_txn = KV_NO_INTENT;
+    store->num_versions++;
+    int depth = 1;
+    while(v->older != NULL && depth < KV_MAX_VERSIONS) {
+        v = v->older;
+        depth++;
+    }
+    struct KvVersion* stale = v->older;
+    v->older = NULL;
+    while(stale != NULL) {
+        struct KvVersion* older = stale->older;
+        free(stale);
+        store->num_versions--;
+        stale = older;
+    }
+}
+
+// Reads the newest version committed at or before snapshot, or the newest
+// committed one when snapshot is 0. Intents are invisible. Returns the
+// version's commit timestamp, 0 if the key had no committed version at
+// snapshot, or KV_TOO_OLD if it had one that has since been dropped.
+static inline long long kvRead(struct KvStore* store, int key, long long snapshot, int* value) {
+    store->num_reads++;
+    struct KvEntry* e = kvFind(store, key, 0);
+    struct KvVersion* v = (e != NULL) ? e->newest : NULL;
+    while(v != NULL && snapshot > 0 && v->commit_ts > snapshot) {
+        v = v->older;
+    }
+    if(v == NULL) {
+        if(e != NULL && e->first_commit_ts != 0 && snapshot >= e->first_commit_ts) {
+            store->num_too_old++;
+            return KV_TOO_OLD;
+        }
+        return 0;
+    }
+    *value = v->value;
+    return v->commit_ts;
+}
+
+#endif
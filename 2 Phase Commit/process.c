@@ -10,22 +10,114 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include "txlog.h"
+#include "kvstore.h"
+#include "failure_detector.h"
 
 #define VOTE_LEN sizeof(struct VoteMessage)
+#define MAX_PARTICIPANTS 1024
+#define THREE_PHASE 1
+// above any state a STATE_REPORT carries in flags
+#define BATCH (1<<16)
+#define MAX_BATCH 128
+#define BATCH_BUFFER_LEN (sizeof(struct BatchHeader) + sizeof(int) * MAX_PARTICIPANTS + VOTE_LEN * MAX_BATCH)
+#define TXN_TABLE_SIZE 4096
+#define DECIDED_HISTORY (1<<16)
+#define IDLE_TIMEOUT_MS (120*1000)
+#define TERMINATION_TIMEOUT_MS 1000
+#define SUSPECTED_ROUND_MS 50
+#define SOCKET_BUFFER_SIZE (4<<20)
+#define LOG_PATH_FORMAT "/tmp/2pc_process_%d.log"
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, ACK};
+enum MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, ACK, DECISION_REQUEST, VOTE_READONLY, COMMIT_REQUEST,
+    PRE_COMMIT, PRE_COMMIT_ACK, STATE_REPORT, KV_GET, KV_VALUE,
+    HEARTBEAT};
 enum RETRY {DIE, DONT_DIE};
 
-enum MSG_TYPE STATE = INIT;
+int verbose = 1;
+int self_port;
+struct KvStore* store = NULL;
+int kv_key_space;
+int kv_writes;
+struct FailureDetector coordinator_detector;
+long long messages_sent = 0;
+volatile sig_atomic_t running = 1;
 
 struct VoteMessage {
 	int flags;
+	int txn;
 	enum MSG_TYPE msg;
 };
 
+// VOTE_REQUEST carries the ports of everyone asked to vote, so a blocked
+// participant knows which peers to ask for the outcome.
+struct VoteRequest {
+    struct VoteMessage vote;
+    int num_participants;
+    int participants[MAX_PARTICIPANTS];
+};
+
+// KV_GET reads key as of snapshot (0 for the newest commit) without waiting
+// for prepared writers. The KV_VALUE answer carries the value and, in
+// snapshot, the commit timestamp of the version read: 0 if there is none,
+// KV_TOO_OLD if the shard no longer keeps versions that old.
+struct KvMessage {
+    int flags;
+    int key;
+    enum MSG_TYPE msg;
+    long long snapshot;
+    int value;
+};
+
+// Header of a datagram carrying many transactions' messages, followed by the
+// participant ports when it holds a VOTE_REQUEST, then count VoteMessages.
+struct BatchHeader {
+    int flags;
+    int count;
+    int num_participants;
+};
+
+// Participant side of the per-transaction state machine: the vote we cast
+// (VOTE_COMMIT means prepared and in doubt, PRE_COMMIT that everyone voted
+// commit), then the decision. Finished transactions stay on a bounded
+// history FIFO so blocked peers can ask. reports[i] holds the state peer i
+// last reported during three-phase termination. write_keys are the keys
+// whose intents we hold in the KV store until the decision.
+struct Transaction {
+    int txn;
+    enum MSG_TYPE state;
+    int three_phase;
+    int num_writes;
+    int* write_keys;
+    long long prepared_at;
+    int num_peers;
+    int* peers;
+    char* reports;
+    int termination_rounds;
+    struct Transaction* next;
+    struct Transaction* next_finished;
+};
+
+// Votes wait in the outbox until the prepare records behind them are durable.
+// Once the coordinator batches, the outbox goes back to it in batches too.
+struct TransactionTable {
+    struct Transaction* buckets[TXN_TABLE_SIZE];
+    struct Transaction* oldest_finished;
+    struct Transaction* newest_finished;
+    int num_finished;
+    int num_prepared;
+    int settled_by_peers;
+    struct TxLog* log;
+    struct VoteMessage* outbox;
+    int num_outbox;
+    int outbox_capacity;
+    int batch_replies;
+};
+
 char* getMessageTag(enum MSG_TYPE msg) {
     if(msg == START_2PC) {
         return "START2PC";
@@ -43,6 +135,18 @@ char* getMessageTag(enum MSG_TYPE msg) {
         return "GLOBAL_ABORT";
     } else if(msg == ACK) {
         return "ACK";
+    } else if(msg == DECISION_REQUEST) {
+        return "DECISION_REQUEST";
+    } else if(msg == VOTE_READONLY) {
+        return "VOTE_READONLY";
+    } else if(msg == COMMIT_REQUEST) {
+        return "COMMIT_REQUEST";
+    } else if(msg == PRE_COMMIT) {
+        return "PRE_COMMIT";
+    } else if(msg == PRE_COMMIT_ACK) {
+        return "PRE_COMMIT_ACK";
+    } else if(msg == STATE_REPORT) {
+        return "STATE_REPORT";
     } else {
         return "UNK";
     }
@@ -64,79 +168,626 @@ char* getMessageDetails(enum MSG_TYPE msg) {
     } else if(msg == GLOBAL_ABORT) {
         return "Received GLOBAL_ABORT from coordinator...";
     } else if(msg == ACK) {
-        return "ACK";
+        return "Sending ACK to coordinator...";
+    } else if(msg == DECISION_REQUEST) {
+        return "Sending DECISION_REQUEST to coordinator...";
+    } else if(msg == VOTE_READONLY) {
+        return "Sending VOTE_READONLY to coordinator...";
+    } else if(msg == COMMIT_REQUEST) {
+        return "Received one-phase COMMIT_REQUEST from coordinator...";
+    } else if(msg == PRE_COMMIT) {
+        return "Received PRE_COMMIT, everyone voted commit...";
+    } else if(msg == PRE_COMMIT_ACK) {
+        return "Sending PRE_COMMIT_ACK to coordinator...";
+    } else if(msg == STATE_REPORT) {
+        return "Reporting our state to a blocked peer...";
     } else {
         return "UNK";
     }
 }
 
 void LOG(enum MSG_TYPE msg) {
-    printf("[%s] %s\n", getMessageTag(msg), getMessageDetails(msg));
+    if(verbose) {
+        printf("[%s] %s\n", getMessageTag(msg), getMessageDetails(msg));
+    }
 }
 
 int sendVote(int sock, struct VoteMessage* vote, struct sockaddr_in* addr) {
 	return sendto(sock, vote, VOTE_LEN, 0, (struct sockaddr*)addr, sizeof(struct sockaddr));
 }
 
-void performVoting(int sock, enum MSG_TYPE msg, struct sockaddr_in* addr) {
+void sendVoteMessage(int sock, int txn, enum MSG_TYPE msg, int flags, struct sockaddr_in* addr) {
     struct VoteMessage vote;
+    vote.flags = flags;
+    vote.txn = txn;
     vote.msg = msg;
     if(sendVote(sock, &vote, addr) < 0) {
         handle_error("performVoting()");
     }
+    messages_sent++;
 }
 
-int getServerVote(int sock, struct VoteMessage *vote) {
-	return recv(sock, (struct VoteMessage*)vote, VOTE_LEN, 0);
+void performVoting(int sock, int txn, enum MSG_TYPE msg, struct sockaddr_in* addr) {
+    sendVoteMessage(sock, txn, msg, 0, addr);
 }
 
-int getVote(int sock, struct VoteMessage* vote, struct sockaddr* addr) {
+int getServerVote(int sock, char* buffer, int flags, struct sockaddr_in* addr) {
     socklen_t addrlen = sizeof(struct sockaddr);
-	return recvfrom(sock, (struct VoteMessage*)vote, VOTE_LEN, 0, addr, &addrlen);
+	return recvfrom(sock, buffer, BATCH_BUFFER_LEN, flags, (struct sockaddr*)addr, &addrlen);
 }
 
-void waitForVote(int sock, struct VoteMessage* vote, struct sockaddr* addr) {
-	if(getVote(sock, vote, addr) < 0) {
-		handle_error("waitForVote()");
-		exit(EXIT_FAILURE);
-	}
+long long getMonotonicTimeMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int waitForServerVote(int sock, struct VoteMessage* vote, enum RETRY retry) {
-	int status = getServerVote(sock, vote);
-    if(status < 0) {
-		if(errno == EAGAIN || errno == EWOULDBLOCK) {
-			if(retry == DONT_DIE) {
-				errno = -1;
-				return waitForServerVote(sock, vote, DONT_DIE);
-			}
-            LOG(VOTE_ABORT);
-			exit(EXIT_FAILURE);
-		}
-        return status;
-	}
+long long getMonotonicTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void setTimeout(int sock, int duration) {
+void setTimeout(int sock, int duration_ms) {
 	struct timeval to;      
-    to.tv_sec = duration;
-    to.tv_usec = 0;
+    to.tv_sec = duration_ms / 1000;
+    to.tv_usec = (duration_ms % 1000) * 1000;
 	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&to, sizeof(struct timeval)) < 0) {
 		handle_error("setsockopt()");
 	}
 }
 
 void enableTimeout(int sock) {
-	setTimeout(sock, 120);
+	setTimeout(sock, FD_HEARTBEAT_INTERVAL_MS);
 }
 
 void disableTimeout(int sock) {
 	setTimeout(sock, 0);
 }
 
+void enableLargeBuffers(int sock) {
+    int size = SOCKET_BUFFER_SIZE;
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) < 0) {
+        handle_error("setsockopt()");
+    }
+}
+
+int isInDoubt(enum MSG_TYPE state) {
+    return state == VOTE_COMMIT || state == PRE_COMMIT;
+}
+
+struct Transaction** getBucket(struct TransactionTable* table, int txn) {
+    return &table->buckets[(unsigned int)txn % TXN_TABLE_SIZE];
+}
+
+struct Transaction* findTransaction(struct TransactionTable* table, int txn) {
+    struct Transaction* t = *getBucket(table, txn);
+    while(t != NULL && t->txn != txn) {
+        t = t->next;
+    }
+    return t;
+}
+
+struct Transaction* createTransaction(struct TransactionTable* table, int txn) {
+    struct Transaction* t = (struct Transaction*)calloc(1, sizeof(struct Transaction));
+    t->txn = txn;
+    t->state = INIT;
+    struct Transaction** bucket = getBucket(table, txn);
+    t->next = *bucket;
+    *bucket = t;
+    return t;
+}
+
+void removeTransaction(struct TransactionTable* table, struct Transaction* t) {
+    struct Transaction** link = getBucket(table, t->txn);
+    while(*link != t) {
+        link = &(*link)->next;
+    }
+    *link = t->next;
+    if(isInDoubt(t->state)) {
+        table->num_prepared--;
+    }
+    free(t->peers);
+    free(t->reports);
+    free(t->write_keys);
+    free(t);
+}
+
+// The writes a transaction staged become versions if it committed and are
+// dropped otherwise. Nothing to undo: older versions were never touched.
+void applyWrites(struct Transaction* t, enum MSG_TYPE decision) {
+    if(t->num_writes == 0) {
+        return;
+    }
+    long long commit_ts = (decision == GLOBAL_COMMIT) ? kvNextTimestamp(store) : 0;
+    for(int i = 0; i < t->num_writes; i++) {
+        if(decision == GLOBAL_COMMIT) {
+            kvInstall(store, t->txn, t->write_keys[i], commit_ts);
+        } else {
+            kvDiscard(store, t->txn, t->write_keys[i]);
+        }
+    }
+    free(t->write_keys);
+    t->write_keys = NULL;
+    t->num_writes = 0;
+}
+
+// The synthetic workload: transaction txn writes kv_writes keys derived from
+// its id and our port, each set to txn.
+int getWriteKey(int txn, int i) {
+    return (int)(((unsigned int)txn * 2654435761u + (unsigned int)i * 40503u + (unsigned int)self_port * 97u) % kv_key_space);
+}
+
+// Places intents on every key txn writes and logs their redo images. A key
+// held by another prepared transaction makes us vote abort, releasing
+// whatever we staged so far.
+enum MSG_TYPE stageWrites(struct TransactionTable* table, struct Transaction* t) {
+    t->write_keys = (int*)malloc(sizeof(int) * kv_writes);
+    for(int i = 0; i < kv_writes; i++) {
+        int key = getWriteKey(t->txn, i);
+        if(!kvStage(store, t->txn, key, t->txn)) {
+            applyWrites(t, GLOBAL_ABORT);
+            return VOTE_ABORT;
+        }
+        t->write_keys[t->num_writes++] = key;
+    }
+    for(int i = 0; i < t->num_writes; i++) {
+        txlogAppendWrite(table->log, t->txn, t->write_keys[i], t->txn);
+    }
+    return (t->num_writes > 0) ? VOTE_COMMIT : VOTE_READONLY;
+}
+
+// Moves a transaction we are done with onto the history FIFO, evicting the
+// oldest entry once the history is full.
+void finishTransaction(struct TransactionTable* table, struct Transaction* t, enum MSG_TYPE state) {
+    if(isInDoubt(t->state)) {
+        table->num_prepared--;
+    }
+    applyWrites(t, state);
+    t->state = state;
+    if(table->newest_finished == NULL) {
+        table->oldest_finished = t;
+    } else {
+        table->newest_finished->next_finished = t;
+    }
+    table->newest_finished = t;
+    if(++table->num_finished > DECIDED_HISTORY) {
+        struct Transaction* oldest = table->oldest_finished;
+        table->oldest_finished = oldest->next_finished;
+        table->num_finished--;
+        removeTransaction(table, oldest);
+    }
+}
+
+enum MSG_TYPE getProcessDecision(enum MSG_TYPE policy, int txn) {
+    if(policy != INIT) {
+        return policy;
+    }
+    char process_decision[9];
+    printf("Enter COMMIT to proceed with voting, READONLY if nothing changed or ABORT to abort transaction %d: ", txn);
+    if(scanf("%8s", process_decision) == 1 && strcmp(process_decision, "COMMIT") == 0) {
+        return VOTE_COMMIT;
+    } else if(strcmp(process_decision, "READONLY") == 0) {
+        return VOTE_READONLY;
+    }
+    return VOTE_ABORT;
+}
+
+void queueVote(struct TransactionTable* table, int txn, enum MSG_TYPE msg) {
+    if(table->num_outbox == table->outbox_capacity) {
+        table->outbox_capacity = table->outbox_capacity ? table->outbox_capacity << 1 : 1024;
+        table->outbox = (struct VoteMessage*)realloc(table->outbox, sizeof(struct VoteMessage) * table->outbox_capacity);
+    }
+    table->outbox[table->num_outbox].flags = 0;
+    table->outbox[table->num_outbox].txn = txn;
+    table->outbox[table->num_outbox].msg = msg;
+    table->num_outbox++;
+}
+
+void sendVoteBatches(int sock, struct TransactionTable* table, struct sockaddr_in* server_addr) {
+    char buffer[sizeof(struct BatchHeader) + VOTE_LEN * MAX_BATCH];
+    struct BatchHeader* header = (struct BatchHeader*)buffer;
+    header->flags = BATCH;
+    header->num_participants = 0;
+    for(int first = 0; first < table->num_outbox; first += MAX_BATCH) {
+        header->count = (table->num_outbox - first < MAX_BATCH) ? table->num_outbox - first : MAX_BATCH;
+        for(int i = first; i < first + header->count; i++) {
+            LOG(table->outbox[i].msg);
+        }
+        memcpy(buffer + sizeof(struct BatchHeader), table->outbox + first, VOTE_LEN * header->count);
+        size_t len = sizeof(struct BatchHeader) + VOTE_LEN * header->count;
+        if(sendto(sock, buffer, len, 0, (struct sockaddr*)server_addr, sizeof(struct sockaddr)) < 0) {
+            handle_error("sendto(batch)");
+        }
+        messages_sent++;
+    }
+}
+
+// Group commit: every vote and decision record gathered since the last flush
+// shares one fdatasync, after which the held-back votes are sent. Abort
+// records alone never force the log; they go out with the next flush.
+void flushVotes(int sock, struct TransactionTable* table, struct sockaddr_in* server_addr) {
+    if(table->num_outbox == 0) {
+        return;
+    }
+    txlogFlush(table->log);
+    if(table->batch_replies) {
+        sendVoteBatches(sock, table, server_addr);
+        table->num_outbox = 0;
+        return;
+    }
+    for(int i = 0; i < table->num_outbox; i++) {
+        LOG(table->outbox[i].msg);
+        performVoting(sock, table->outbox[i].txn, table->outbox[i].msg, server_addr);
+    }
+    table->num_outbox = 0;
+}
+
+int isVote(enum MSG_TYPE msg) {
+    return msg == VOTE_COMMIT || msg == VOTE_ABORT || msg == VOTE_READONLY;
+}
+
+// A repeated VOTE_REQUEST gets the vote we already cast, never a fresh one.
+// Only a prepared transaction is logged: under presumed abort a read-only or
+// aborting participant is done with it once it has voted.
+void handleVoteRequest(struct TransactionTable* table, struct VoteMessage* request, int num_participants,
+        int* participants, enum MSG_TYPE policy) {
+    int txn = request->txn;
+    LOG(VOTE_REQUEST);
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL) {
+        if(isVote(t->state)) {
+            queueVote(table, txn, t->state);
+        }
+        return;
+    }
+    t = createTransaction(table, txn);
+    enum MSG_TYPE vote = (store != NULL) ? stageWrites(table, t) : getProcessDecision(policy, txn);
+    if(vote == VOTE_COMMIT) {
+        t->state = VOTE_COMMIT;
+        t->three_phase = request->flags & THREE_PHASE;
+        t->prepared_at = getMonotonicTimeMs();
+        t->num_peers = num_participants;
+        t->peers = (int*)malloc(sizeof(int) * t->num_peers);
+        memcpy(t->peers, participants, sizeof(int) * t->num_peers);
+        t->reports = (char*)calloc(t->num_peers, sizeof(char));
+        table->num_prepared++;
+        txlogAppend(table->log, txn, VOTE_COMMIT);
+    } else {
+        finishTransaction(table, t, vote);
+    }
+    queueVote(table, txn, vote);
+}
+
+// One-phase commit: we are the only participant, so our vote is the outcome.
+// A commit is logged as decided and never leaves us in doubt. A repeated
+// COMMIT_REQUEST gets the outcome again and stages nothing.
+void handleCommitRequest(struct TransactionTable* table, int txn, enum MSG_TYPE policy) {
+    LOG(COMMIT_REQUEST);
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL) {
+        if(t->state == GLOBAL_COMMIT || t->state == GLOBAL_ABORT) {
+            queueVote(table, txn, (t->state == GLOBAL_COMMIT) ? VOTE_COMMIT : VOTE_ABORT);
+        }
+        return;
+    }
+    t = createTransaction(table, txn);
+    enum MSG_TYPE vote = (store != NULL) ? stageWrites(table, t) : getProcessDecision(policy, txn);
+    if(vote == VOTE_COMMIT) {
+        txlogAppend(table->log, txn, GLOBAL_COMMIT);
+    }
+    finishTransaction(table, t, (vote == VOTE_ABORT) ? GLOBAL_ABORT : GLOBAL_COMMIT);
+    queueVote(table, txn, vote);
+}
+
+// Commits are acknowledged once durable so the coordinator can forget them;
+// aborts are not. A repeated commit is acknowledged again. The decision may
+// come from the coordinator or from a peer that already knew it.
+void handleDecision(struct TransactionTable* table, int txn, enum MSG_TYPE decision, int from_peer) {
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL && isInDoubt(t->state)) {
+        LOG(decision);
+        txlogAppend(table->log, txn, decision);
+        finishTransaction(table, t, decision);
+        if(from_peer) {
+            table->settled_by_peers++;
+        }
+    }
+    if(decision == GLOBAL_COMMIT) {
+        queueVote(table, txn, ACK);
+    }
+}
+
+// PRE_COMMIT comes from the coordinator or from a peer acting as backup;
+// either way everyone voted commit. Only the coordinator wants the ACK. One
+// for a transaction a backup already settled gets the outcome instead, so
+// the coordinator never commits against it.
+void handlePreCommit(struct TransactionTable* table, int txn) {
+    struct Transaction* t = findTransaction(table, txn);
+    if(t != NULL && (t->state == GLOBAL_COMMIT || t->state == GLOBAL_ABORT)) {
+        queueVote(table, txn, t->state);
+        return;
+    }
+    if(t == NULL || !isInDoubt(t->state)) {
+        return;
+    }
+    if(t->state == VOTE_COMMIT) {
+        LOG(PRE_COMMIT);
+        t->state = PRE_COMMIT;
+        t->three_phase = 1;
+        txlogAppend(table->log, txn, PRE_COMMIT);
+    }
+    queueVote(table, txn, PRE_COMMIT_ACK);
+}
+
+// Cooperative termination: a peer that knows the outcome, or that voted
+// abort, can settle it for a blocked participant. One that is itself in
+// doubt only reports its state, and only for a three-phase transaction.
+// One that voted read-only or never saw the transaction stays silent.
+void answerPeer(int sock, struct TransactionTable* table, struct VoteMessage* vote, struct sockaddr_in* addr) {
+    struct Transaction* t = findTransaction(table, vote->txn);
+    if(t == NULL) {
+        return;
+    }
+    if(t->state == GLOBAL_COMMIT || t->state == GLOBAL_ABORT) {
+        performVoting(sock, vote->txn, t->state, addr);
+    } else if(t->state == VOTE_ABORT) {
+        performVoting(sock, vote->txn, GLOBAL_ABORT, addr);
+    } else if(isInDoubt(t->state) && (vote->flags & THREE_PHASE)) {
+        sendVoteMessage(sock, vote->txn, STATE_REPORT, t->state, addr);
+    }
+}
+
+void handleStateReport(struct TransactionTable* table, struct VoteMessage* vote, struct sockaddr_in* addr) {
+    struct Transaction* t = findTransaction(table, vote->txn);
+    if(t == NULL || !isInDoubt(t->state)) {
+        return;
+    }
+    for(int p = 0; p < t->num_peers; p++) {
+        if(t->peers[p] == addr->sin_port) {
+            t->reports[p] = vote->flags;
+        }
+    }
+}
+
+void answerRead(int sock, struct KvMessage* request, struct sockaddr_in* addr) {
+    struct KvMessage reply;
+    memset(&reply, 0, sizeof(struct KvMessage));
+    reply.key = request->key;
+    reply.msg = KV_VALUE;
+    reply.snapshot = kvRead(store, request->key, request->snapshot, &reply.value);
+    if(sendto(sock, &reply, sizeof(struct KvMessage), 0, (struct sockaddr*)addr, sizeof(struct sockaddr)) < 0) {
+        handle_error("sendto(KV_VALUE)");
+    }
+    messages_sent++;
+}
+
+void handleMessage(int sock, struct TransactionTable* table, struct VoteMessage* vote, int num_participants,
+        int* participants, enum MSG_TYPE policy, struct sockaddr_in* addr, struct sockaddr_in* server_addr) {
+    if(vote->msg == VOTE_REQUEST) {
+        handleVoteRequest(table, vote, num_participants, participants, policy);
+    } else if(vote->msg == COMMIT_REQUEST) {
+        handleCommitRequest(table, vote->txn, policy);
+    } else if(vote->msg == PRE_COMMIT) {
+        handlePreCommit(table, vote->txn);
+    } else if(vote->msg == GLOBAL_COMMIT || vote->msg == GLOBAL_ABORT) {
+        handleDecision(table, vote->txn, vote->msg, addr->sin_port != server_addr->sin_port);
+    } else if(vote->msg == DECISION_REQUEST) {
+        answerPeer(sock, table, vote, addr);
+    } else if(vote->msg == STATE_REPORT) {
+        handleStateReport(table, vote, addr);
+    } else if(vote->msg == HEARTBEAT) {
+        if(addr->sin_port == server_addr->sin_port) {
+            fdHeartbeat(&coordinator_detector, getMonotonicTimeUs());
+        }
+    } else if(vote->msg == KV_GET && store != NULL) {
+        answerRead(sock, (struct KvMessage*)vote, addr);
+    }
+}
+
+// A batch is only trusted as far as the datagram that carried it reaches.
+int isValidBatch(struct BatchHeader* header, int len) {
+    if(header->count < 0 || header->count > MAX_BATCH || header->num_participants < 0 || header->num_participants > MAX_PARTICIPANTS) {
+        return 0;
+    }
+    return len >= (int)(sizeof(struct BatchHeader) + sizeof(int) * header->num_participants + VOTE_LEN * header->count);
+}
+
+// A batch shares one participant list between all the VOTE_REQUESTs in it.
+void handleDatagram(int sock, struct TransactionTable* table, char* buffer, int len, enum MSG_TYPE policy,
+        struct sockaddr_in* addr, struct sockaddr_in* server_addr) {
+    struct BatchHeader* header = (struct BatchHeader*)buffer;
+    if(!(header->flags & BATCH)) {
+        struct VoteRequest* request = (struct VoteRequest*)buffer;
+        handleMessage(sock, table, &request->vote, request->num_participants, request->participants, policy, addr, server_addr);
+        return;
+    }
+    if(!isValidBatch(header, len)) {
+        return;
+    }
+    table->batch_replies = 1;
+    int* participants = (int*)(buffer + sizeof(struct BatchHeader));
+    struct VoteMessage* votes = (struct VoteMessage*)(participants + header->num_participants);
+    for(int i = 0; i < header->count; i++) {
+        handleMessage(sock, table, &votes[i], header->num_participants, participants, policy, addr, server_addr);
+    }
+}
+
+void sendToPort(int sock, int txn, enum MSG_TYPE msg, int flags, int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = port;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendVoteMessage(sock, txn, msg, flags, &addr);
+}
+
+void sendToPeers(int sock, struct Transaction* t, enum MSG_TYPE msg, int flags) {
+    for(int p = 0; p < t->num_peers; p++) {
+        if(t->peers[p] != self_port) {
+            sendToPort(sock, t->txn, msg, flags, t->peers[p]);
+        }
+    }
+}
+
+// Three-phase termination, run by the live participant with the lowest port
+// once a round of state reports is in. If nobody got PRE_COMMIT the failed
+// coordinator cannot have committed, so we abort. Otherwise everyone voted
+// commit: bring the stragglers to PRE_COMMIT first, then commit, so a backup
+// that fails half way never leaves an outcome the next one cannot repeat.
+// Returns 1 once the transaction is settled.
+int terminateThreePhase(int sock, struct TransactionTable* table, struct Transaction* t) {
+    int backup = 1, any_pre_commit = (t->state == PRE_COMMIT), all_pre_commit = any_pre_commit;
+    for(int p = 0; p < t->num_peers; p++) {
+        if(t->reports[p] == 0) {
+            continue;
+        }
+        if(t->peers[p] < self_port) {
+            backup = 0;
+        }
+        if(t->reports[p] == PRE_COMMIT) {
+            any_pre_commit = 1;
+        } else {
+            all_pre_commit = 0;
+        }
+        t->reports[p] = 0;
+    }
+    if(!backup || t->termination_rounds++ == 0) {
+        return 0;
+    }
+    if(!any_pre_commit || all_pre_commit) {
+        enum MSG_TYPE decision = any_pre_commit ? GLOBAL_COMMIT : GLOBAL_ABORT;
+        if(verbose) {
+            printf("[LOG] Acting as backup coordinator, deciding %s for transaction %d\n", getMessageTag(decision), t->txn);
+        }
+        txlogAppend(table->log, t->txn, decision);
+        txlogFlush(table->log);
+        sendToPeers(sock, t, decision, 0);
+        finishTransaction(table, t, decision);
+        table->settled_by_peers++;
+        return 1;
+    }
+    if(t->state == VOTE_COMMIT) {
+        t->state = PRE_COMMIT;
+        txlogAppend(table->log, t->txn, PRE_COMMIT);
+        txlogFlush(table->log);
+    }
+    sendToPeers(sock, t, PRE_COMMIT, 0);
+    return 0;
+}
+
+// Asks the coordinator and every peer about each transaction that has been
+// in doubt for at least min_age ms; the first answer settles it. Peers only
+// elect a backup for a three-phase transaction while the coordinator is
+// suspected: a live coordinator may still pre-commit it, so until then they
+// only answer with outcomes they know, and stale state reports are dropped.
+void requestDecisions(int sock, struct TransactionTable* table, struct sockaddr_in* server_addr, long long min_age,
+        int coordinator_suspected) {
+    long long now = getMonotonicTimeMs();
+    for(int i = 0; i < TXN_TABLE_SIZE; i++) {
+        struct Transaction* next;
+        for(struct Transaction* t = table->buckets[i]; t != NULL; t = next) {
+            next = t->next;
+            if(!isInDoubt(t->state) || now - t->prepared_at < min_age) {
+                continue;
+            }
+            int terminating = t->three_phase && coordinator_suspected;
+            if(terminating && terminateThreePhase(sock, table, t)) {
+                continue;
+            }
+            if(t->three_phase && !terminating && t->reports != NULL) {
+                memset(t->reports, 0, t->num_peers);
+                t->termination_rounds = 0;
+            }
+            LOG(DECISION_REQUEST);
+            performVoting(sock, t->txn, DECISION_REQUEST, server_addr);
+            sendToPeers(sock, t, DECISION_REQUEST, terminating ? THREE_PHASE : 0);
+        }
+    }
+}
+
+void stopProcess(int signum) {
+    (void)signum;
+    running = 0;
+}
+
+// Replays the log: transactions we prepared but never saw a decision for are
+// still in doubt, so we ask the coordinator how they ended. Peers are not
+// logged, so after a restart only the coordinator can answer. In KV mode the
+// redo images rebuild the store: committed writes are installed again and an
+// in-doubt transaction gets its intents back.
+void recoverTransactions(int sock, struct TransactionTable* table, const char* log_path, struct sockaddr_in* server_addr) {
+    int num_records;
+    struct LogRecord* records = txlogRead(log_path, &num_records);
+    for(int i = 0; i < num_records; i++) {
+        if(records[i].type == TXLOG_WRITE && store == NULL) {
+            continue;
+        }
+        struct Transaction* t = findTransaction(table, records[i].txn);
+        if(t == NULL) {
+            t = createTransaction(table, records[i].txn);
+        }
+        if(records[i].type == TXLOG_WRITE) {
+            t->write_keys = (int*)realloc(t->write_keys, sizeof(int) * (t->num_writes + 1));
+            t->write_keys[t->num_writes++] = records[i].key;
+            kvStage(store, t->txn, records[i].key, records[i].value);
+            continue;
+        }
+        if(isInDoubt(records[i].type) && !isInDoubt(t->state)) {
+            table->num_prepared++;
+        } else if(!isInDoubt(records[i].type) && isInDoubt(t->state)) {
+            table->num_prepared--;
+        }
+        t->state = records[i].type;
+        if(!isInDoubt(t->state)) {
+            applyWrites(t, t->state);
+            removeTransaction(table, t);
+        }
+    }
+    free(records);
+    // Writes with no vote after them were torn off the end of a group
+    // write. The transaction never voted, so it is presumed aborted and
+    // must not keep its intents.
+    for(int i = 0; i < TXN_TABLE_SIZE; i++) {
+        struct Transaction* t = table->buckets[i];
+        while(t != NULL) {
+            struct Transaction* next = t->next;
+            if(t->state == INIT) {
+                applyWrites(t, GLOBAL_ABORT);
+                removeTransaction(table, t);
+            }
+            t = next;
+        }
+    }
+    if(table->num_prepared > 0) {
+        printf("Recovered %d in-doubt transaction(s) from %s\n", table->num_prepared, log_path);
+    }
+    requestDecisions(sock, table, server_addr, 0, 0);
+}
+
+// ./process SERVER_PORT CLIENT_OFFSET [COMMIT|READONLY|ABORT|KV [KEY_SPACE [WRITES_PER_TXN]]]
+// Without a policy every vote is read from stdin; with one the process votes on its own and stays quiet.
+// KV hosts a key-value shard: each transaction writes WRITES_PER_TXN keys out of KEY_SPACE and the vote
+// is an abort only when one of them is held by another prepared transaction.
 int main(int argc, char **argv) {
 	int server_port = (argc > 1) ? atoi(argv[1]) : (1<<13)+5;
 	int port = (argc > 2) ? (server_port<<1)+atoi(argv[2]) : (server_port<<1);
+    self_port = port;
+    enum MSG_TYPE policy = INIT;
+    if(argc > 3) {
+        if(strcmp(argv[3], "COMMIT") == 0) {
+            policy = VOTE_COMMIT;
+        } else if(strcmp(argv[3], "READONLY") == 0) {
+            policy = VOTE_READONLY;
+        } else if(strcmp(argv[3], "KV") == 0) {
+            store = (struct KvStore*)calloc(1, sizeof(struct KvStore));
+            kv_key_space = (argc > 4) ? atoi(argv[4]) : (1<<20);
+            kv_writes = (argc > 5) ? atoi(argv[5]) : 4;
+        } else {
+            policy = VOTE_ABORT;
+        }
+        verbose = 0;
+    }
 
 	int sock;
 	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -156,6 +807,7 @@ int main(int argc, char **argv) {
 	printf("Started client on port %d\n", port);
 
 	enableTimeout(sock);
+    enableLargeBuffers(sock);
 
 	struct sockaddr_in server_addr;
 	memset(&server_addr, 0, sizeof(struct sockaddr_in));
@@ -163,43 +815,85 @@ int main(int argc, char **argv) {
 	server_addr.sin_port = server_port;
 	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	struct VoteMessage vote;
-	do {
-		LOG(INIT);
+    char log_path[64];
+    sprintf(log_path, LOG_PATH_FORMAT, port);
+    struct TransactionTable* table = (struct TransactionTable*)calloc(1, sizeof(struct TransactionTable));
+    recoverTransactions(sock, table, log_path, &server_addr);
+    table->log = txlogOpen(log_path);
 
-        if(waitForServerVote(sock, &vote, DIE) < 0) {
-            LOG(VOTE_ABORT);
-            exit(EXIT_FAILURE);
-        }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = stopProcess;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-        assert(vote.msg == VOTE_REQUEST);
-        LOG(VOTE_REQUEST);
+	char buffer[BATCH_BUFFER_LEN];
+    struct sockaddr_in from;
+    long long last_message = getMonotonicTimeMs();
+    long long last_termination = last_message;
+    long long next_heartbeat = 0;
+    int suspected = 0;
+    LOG(INIT);
+	while(running) {
+        long long now = getMonotonicTimeMs();
+        int len = getServerVote(sock, buffer, 0, &from);
+        if(len < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                handle_error("recv()");
+            }
+            now = getMonotonicTimeMs();
+            if(table->num_prepared == 0 && now - last_message >= IDLE_TIMEOUT_MS) {
+                break;
+            }
+        } else {
+            last_message = now;
+            do {
+                handleDatagram(sock, table, buffer, len, policy, &from, &server_addr);
+            } while((len = getServerVote(sock, buffer, MSG_DONTWAIT, &from)) >= 0);
+            flushVotes(sock, table, &server_addr);
+        }
 
-        char* process_decision = (char*)malloc(sizeof(char) * 8);
-        printf("Enter COMMIT to proceed with voting or ABORT to abort: ");
-        scanf("%s", process_decision);
-        
-        if(strcmp(process_decision, "COMMIT") == 0) {
-            LOG(VOTE_COMMIT);
-            performVoting(sock, VOTE_COMMIT, &server_addr);
+        if(now >= next_heartbeat) {
+            sendVoteMessage(sock, 0, HEARTBEAT, 0, &server_addr);
+            next_heartbeat = now + FD_HEARTBEAT_INTERVAL_MS;
+        }
 
-            if(waitForServerVote(sock, &vote, DIE) < 0) {
-                // multicast DECISION_REQUEST
+        // once the coordinator is suspected nobody waits out TERMINATION_TIMEOUT_MS:
+        // every in-doubt transaction goes to the peers, in quick rounds
+        long long now_us = getMonotonicTimeUs();
+        if(fdSuspect(&coordinator_detector, now_us) != suspected) {
+            suspected = !suspected;
+            if(verbose || (suspected && table->num_prepared > 0)) {
+                printf("[LOG] %s the coordinator (phi=%.1f)\n", suspected ? "Suspecting" : "Trusting",
+                        fdPhi(&coordinator_detector, now_us));
             }
-
-            enum MSG_TYPE DECISION = vote.msg;
-            if(DECISION == GLOBAL_COMMIT) {
-                LOG(GLOBAL_COMMIT);
-            } else {
-                LOG(GLOBAL_ABORT);
+        }
+        // the detector needs a few heartbeats before it suspects anyone; a coordinator
+        // silent for a whole termination round is down all the same
+        int coordinator_down = suspected || now_us - coordinator_detector.last_arrival_us >= TERMINATION_TIMEOUT_MS * 1000LL;
+        long long round_ms = suspected ? SUSPECTED_ROUND_MS : TERMINATION_TIMEOUT_MS;
+        if(table->num_prepared > 0 && now - last_termination >= round_ms) {
+            if(verbose) {
+                printf("[LOG] %d transaction(s) in doubt, asking the coordinator and peers...\n", table->num_prepared);
             }
-        } else {
-            LOG(VOTE_ABORT);
-            performVoting(sock, VOTE_ABORT, &server_addr);
+            requestDecisions(sock, table, &server_addr, suspected ? 0 : TERMINATION_TIMEOUT_MS, coordinator_down);
+            last_termination = now;
         }
-	} while(0);
+	}
 
+    printf("Sent %lld messages, %d transaction(s) settled by peers, %d still in doubt\n", messages_sent,
+            table->settled_by_peers, table->num_prepared);
+    if(store != NULL) {
+        printf("Store holds %d keys in %lld versions after %lld commits; %lld write conflicts, %lld reads (%lld too old)\n",
+                store->num_keys, store->num_versions, store->clock, store->num_conflicts, store->num_reads, store->num_too_old);
+    }
+
+    txlogClose(table->log);
+    free(table);
 	close(sock);
 	
 	return 0;
-}
\ No newline at end of file
+}
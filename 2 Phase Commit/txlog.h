@@ -0,0 +1,236 @@
+#ifndef TXLOG_H
+#define TXLOG_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Append-only transaction log shared by the coordinator and the participants.
+// Records are buffered by txlogAppend and made durable in groups: one write
+// and one fdatasync per txlogFlush, however many transactions they cover.
+// TXLOG_WRITE records carry the redo image of one key a transaction wrote.
+//
+// A log starts with a header record naming its format version. Logs from
+// before the header held two-int records of just txn and type; they are
+// still read, and txlogOpen rewrites them in the current format before
+// appending to them. A crash in the middle of a write leaves a torn record
+// at the tail, which txlogOpen cuts off so that later records stay aligned.
+
+#define TXLOG_WRITE (-1)
+#define TXLOG_HEADER (-2)
+#define TXLOG_MAGIC 0x54584c47
+#define TXLOG_VERSION 2
+
+struct LogRecord {
+    int txn;
+    int type;
+    int key;
+    int value;
+};
+
+struct LegacyLogRecord {
+    int txn;
+    int type;
+};
+
+struct TxLog {
+    int fd;
+    struct LogRecord* pending;
+    int num_pending;
+    int capacity;
+    long long num_records;
+    long long num_syncs;
+};
+
+static inline int txlogIsHeader(struct LogRecord* record) {
+    return record->txn == TXLOG_MAGIC && record->type == TXLOG_HEADER;
+}
+
+static inline void txlogWrite(int fd, const void* buf, size_t len) {
+    if(write(fd, buf, len) != (ssize_t)len) {
+        perror("write(txlog)");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void txlogSync(int fd) {
+    if(fdatasync(fd) < 0) {
+        perror("fdatasync(txlog)");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void txlogWriteHeader(int fd) {
+    struct LogRecord header = {TXLOG_MAGIC, TXLOG_HEADER, TXLOG_VERSION, (int)sizeof(struct LogRecord)};
+    txlogWrite(fd, &header, sizeof(struct LogRecord));
+}
+
+// Reads the whole log file, or returns NULL if there is none.
+static inline char* txlogReadFile(const char* path, size_t* size) {
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        perror("fstat(txlog)");
+        exit(EXIT_FAILURE);
+    }
+    char* data = (char*)malloc(st.st_size + 1);
+    if(read(fd, data, st.st_size) != (ssize_t)st.st_size) {
+        perror("read(txlog)");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    *size = st.st_size;
+    return data;
+}
+
+// Returns every complete record in the log, oldest first, in the current
+// format whatever format the file is in. A torn tail left by a crash in the
+// middle of a write is ignored.
+static inline struct LogRecord* txlogRead(const char* path, int* num_records) {
+    *num_records = 0;
+    size_t size;
+    char* data = txlogReadFile(path, &size);
+    if(data == NULL) {
+        return NULL;
+    }
+    struct LogRecord* header = (struct LogRecord*)data;
+    if(size >= sizeof(struct LogRecord) && txlogIsHeader(header)) {
+        if(header->key > TXLOG_VERSION || header->value != (int)sizeof(struct LogRecord)) {
+            fprintf(stderr, "%s is in log format %d, which this build cannot read\n", path, header->key);
+            exit(EXIT_FAILURE);
+        }
+        int count = size / sizeof(struct LogRecord) - 1;
+        memmove(data, data + sizeof(struct LogRecord), sizeof(struct LogRecord) * count);
+        *num_records = count;
+        return (struct LogRecord*)data;
+    }
+    int count = size / sizeof(struct LegacyLogRecord);
+    struct LegacyLogRecord* legacy = (struct LegacyLogRecord*)data;
+    if(count > 0 && legacy[0].txn == TXLOG_MAGIC && legacy[0].type == TXLOG_HEADER) {
+        // a crash tore the header of a log that had nothing else yet
+        count = 0;
+    }
+    struct LogRecord* records = (struct LogRecord*)calloc(count + 1, sizeof(struct LogRecord));
+    for(int i = 0; i < count; i++) {
+        records[i].txn = legacy[i].txn;
+        records[i].type = legacy[i].type;
+    }
+    free(data);
+    *num_records = count;
+    return records;
+}
+
+// Rewrites a log in the current format under a temporary name and renames
+// it over the original, so a crash leaves one complete log or the other.
+static inline void txlogUpgrade(const char* path) {
+    int num_records;
+    struct LogRecord* records = txlogRead(path, &num_records);
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.upgrade", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        perror("open(txlog upgrade)");
+        exit(EXIT_FAILURE);
+    }
+    txlogWriteHeader(fd);
+    txlogWrite(fd, records, sizeof(struct LogRecord) * num_records);
+    txlogSync(fd);
+    close(fd);
+    if(rename(tmp_path, path) < 0) {
+        perror("rename(txlog upgrade)");
+        exit(EXIT_FAILURE);
+    }
+    printf("Upgraded %s to log format %d (%d records)\n", path, TXLOG_VERSION, num_records);
+    free(records);
+}
+
+// Opens the log for appending: a new log gets its header, an old-format log
+// is upgraded, and a torn tail is cut back to the last complete record.
+static inline struct TxLog* txlogOpen(const char* path) {
+    struct TxLog* log = (struct TxLog*)calloc(1, sizeof(struct TxLog));
+    struct LogRecord header;
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        ssize_t len = read(fd, &header, sizeof(struct LogRecord));
+        close(fd);
+        if(len > 0 && (len < (ssize_t)sizeof(struct LogRecord) || !txlogIsHeader(&header))) {
+            txlogUpgrade(path);
+        }
+    }
+    if((log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        perror("open(txlog)");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if(fstat(log->fd, &st) < 0) {
+        perror("fstat(txlog)");
+        exit(EXIT_FAILURE);
+    }
+    if(st.st_size == 0) {
+        txlogWriteHeader(log->fd);
+        txlogSync(log->fd);
+    } else if(st.st_size % sizeof(struct LogRecord) != 0) {
+        if(ftruncate(log->fd, st.st_size - st.st_size % sizeof(struct LogRecord)) < 0) {
+            perror("ftruncate(txlog)");
+            exit(EXIT_FAILURE);
+        }
+        txlogSync(log->fd);
+    }
+    log->capacity = 1024;
+    log->pending = (struct LogRecord*)malloc(sizeof(struct LogRecord) * log->capacity);
+    return log;
+}
+
+static inline struct LogRecord* txlogNext(struct TxLog* log) {
+    if(log->num_pending == log->capacity) {
+        log->capacity <<= 1;
+        log->pending = (struct LogRecord*)realloc(log->pending, sizeof(struct LogRecord) * log->capacity);
+    }
+    return &log->pending[log->num_pending++];
+}
+
+static inline void txlogAppend(struct TxLog* log, int txn, int type) {
+    struct LogRecord* record = txlogNext(log);
+    record->txn = txn;
+    record->type = type;
+    record->key = 0;
+    record->value = 0;
+}
+
+static inline void txlogAppendWrite(struct TxLog* log, int txn, int key, int value) {
+    struct LogRecord* record = txlogNext(log);
+    record->txn = txn;
+    record->type = TXLOG_WRITE;
+    record->key = key;
+    record->value = value;
+}
+
+static inline int txlogFlush(struct TxLog* log) {
+    int flushed = log->num_pending;
+    if(flushed == 0) {
+        return 0;
+    }
+    txlogWrite(log->fd, log->pending, sizeof(struct LogRecord) * flushed);
+    txlogSync(log->fd);
+    log->num_pending = 0;
+    log->num_records += flushed;
+    log->num_syncs++;
+    return flushed;
+}
+
+static inline void txlogClose(struct TxLog* log) {
+    txlogFlush(log);
+    close(log->fd);
+    free(log->pending);
+    free(log);
+}
+
+#endif
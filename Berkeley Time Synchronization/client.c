@@ -4,43 +4,135 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
 
+#include "clock_page.h"
+
 #define CLIENT_DATA_LEN sizeof(struct ClientMessage)
 #define REQ_LEN sizeof(struct ClientMessage)
+#define PROTOCOL_VERSION 5
+#define NS_PER_SEC 1000000000LL
+#define MAX_SLEW_PPM 500
+#define STEP_THRESHOLD_NS 128000000LL
+#define KERNEL_TIMESTAMPS_FLAG 1
+#define CONTROL_LEN 256
+#define DEFAULT_DRIFT_BOUND_PPB 200000
+#define MIN_DRIFT_BOUND_PPB 20000
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {SYN, SYNACK, ACK};
-
-int TIMESTAMP;
-
+enum MSG_TYPE {SYN, SYNACK, ACK, FIN};
+
+// The clock is CLOCK_MONOTONIC shifted by CLOCK_OFFSET nanoseconds, plus
+// the part of the last correction slewed in since SLEW_START. DRIFT_PPM
+// makes it run fast or slow, to simulate an oscillator that is off.
+long long CLOCK_OFFSET;
+long long SLEW_REMAINING;
+long long SLEW_START;
+long long DRIFT_START;
+int DRIFT_PPM;
+
+// The error bound the master sent with the last correction, when that
+// correction arrived, and how fast the clock may drift away from the
+// synchronized time since then.
+long long SYNC_TIME;
+long long SYNC_ERROR;
+long long DRIFT_BOUND_PPB = DEFAULT_DRIFT_BOUND_PPB;
+
+// Where the clock is published for other processes on the host.
+struct ClockPage* CLOCK_PAGE;
+
+// A SYNACK's time is the clock when the SYN arrived and hold how long the
+// SYN was held before the SYNACK left. A SYN flagged KERNEL_TIMESTAMPS_FLAG
+// asks for that arrival to be the kernel's receive timestamp.
+//
+// Version 5 adds a SYNACK's low and high, the spread of a sub-master's
+// subtree around the time it reports; a client leaves them 0. Version 4
+// added an ACK's error: how far the corrected clock may be from
+// the synchronized time right after the delta is applied. Version 3 added
+// the fields a sub-master fills in for its subtree: a client's SYNACK
+// always stands for one clock. Version 2
+// carried nanosecond clock readings and deltas. Version 1 had no version
+// field and counted whole seconds.
 struct ClientMessage {
 	int flags;
-	int time;
-	int delta;
+	int version;
 	enum MSG_TYPE msg;
+	int round;
+	long long time;
+	long long delta;
+	long long hold;
+	int count;
+	int budget_ms;
+	long long error;
+	long long low;
+	long long high;
 };
 
+long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+long long realtime_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+long long slewed(long long now) {
+	long long applied = (now - SLEW_START) * MAX_SLEW_PPM / 1000000;
+	if(applied >= llabs(SLEW_REMAINING)) {
+		return SLEW_REMAINING;
+	}
+	return (SLEW_REMAINING < 0) ? -applied : applied;
+}
+
+long long local_time_at(long long now) {
+	return now + (now - DRIFT_START) * DRIFT_PPM / 1000000 + CLOCK_OFFSET + slewed(now);
+}
+
+long long local_time() {
+	return local_time_at(monotonic_ns());
+}
+
+// Kernel timestamps are CLOCK_REALTIME. They are moved onto CLOCK_MONOTONIC
+// by the distance between the two clocks now.
+long long kernel_to_monotonic(struct timespec* ts) {
+	long long stamp = (long long)ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+	return stamp - (realtime_ns() - monotonic_ns());
+}
+
+void initMessage(struct ClientMessage* message, enum MSG_TYPE msg) {
+	memset(message, 0, CLIENT_DATA_LEN);
+	message->version = PROTOCOL_VERSION;
+	message->msg = msg;
+}
+
 int sendResponse(int sock, struct ClientMessage* resp, struct sockaddr* addr) {
 	return sendto(sock, resp, CLIENT_DATA_LEN, 0, addr, sizeof(struct sockaddr));
 }
 
 int sendStatusResponse(enum MSG_TYPE msg, int sock, struct sockaddr* addr) {
 	struct ClientMessage resp;
-	resp.msg = msg;
+	initMessage(&resp, msg);
 	return sendResponse(sock, &resp, addr);
 }
 
-int sendTimeResponse(int sock, struct sockaddr* addr) {
+int sendTimeResponse(int sock, struct sockaddr* addr, int round, long long received) {
 	struct ClientMessage resp;
-	resp.time = TIMESTAMP;
-	resp.msg = SYNACK;
+	initMessage(&resp, SYNACK);
+	resp.round = round;
+	resp.count = 1;
+	resp.time = local_time_at(received);
+	resp.hold = monotonic_ns() - received;
 	return sendResponse(sock, &resp, addr);
 }
 
@@ -48,6 +140,31 @@ int waitForMessage(int sock, struct ClientMessage* resp) {
 	return recv(sock, resp, sizeof(struct ClientMessage), 0);
 }
 
+// Also stores who sent the message and when it arrived: the time recvmsg
+// returned, and the kernel's receive timestamp if there is one (0 otherwise).
+int waitForStampedMessage(int sock, struct ClientMessage* resp, struct sockaddr_in* from, long long* received,
+		long long* kernel_received) {
+	char control[CONTROL_LEN];
+	struct iovec iov = {resp, sizeof(struct ClientMessage)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_name = from;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CONTROL_LEN;
+	int len = recvmsg(sock, &msg, 0);
+	*received = monotonic_ns();
+	*kernel_received = 0;
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); len >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			*kernel_received = kernel_to_monotonic((struct timespec*)CMSG_DATA(cmsg));
+		}
+	}
+	return len;
+}
+
 int waitForTimeRequest(int sock, struct ClientMessage* resp) {
 	return waitForMessage(sock, resp);
 }
@@ -56,9 +173,9 @@ int waitForTimeUpdates(int sock, struct ClientMessage* resp) {
 	return waitForMessage(sock, resp);
 }
 
-int sendTimeUpdates(int sock, struct sockaddr* addr, int delta) {
+int sendTimeUpdates(int sock, struct sockaddr* addr, long long delta) {
 	struct ClientMessage resp;
-	resp.msg = ACK;
+	initMessage(&resp, ACK);
 	resp.delta = delta;
 	return sendResponse(sock, &resp, addr);
 }
@@ -69,45 +186,94 @@ void reportAck(int sock, struct sockaddr* addr) {
 	}
 }
 
-int convert_to_timestamp(char* hhmmss) {
+// Nanoseconds since midnight.
+long long convert_to_timestamp(char* hhmmss) {
 	assert(strlen(hhmmss) == 8);
-	char hh[3], mm[3], ss[3];
+	char hh[3] = {0}, mm[3] = {0}, ss[3] = {0};
 	strncpy(hh, hhmmss, 2);
 	strncpy(mm, hhmmss+3, 2);
 	strncpy(ss, hhmmss+6, 2);
 	int hours = atoi(hh);
 	int minutes = atoi(mm);
 	int seconds = atoi(ss);
-	return hours*60*60+minutes*60+seconds;
+	return (hours*60*60+minutes*60+seconds) * NS_PER_SEC;
 }
 
 char* to_string(int time) {
-	char* strtime = (char*)malloc(sizeof(char)*2);
+	char* strtime = (char*)malloc(sizeof(char)*3);
 	sprintf(strtime, "%02d", time);
 	return strtime;
 }
 
-char* convert_from_timestamp(int time) {
-	char* hhmmss = (char*)malloc(sizeof(char)*8);
+// Time of day as hh:mm:ss.uuuuuu.
+char* convert_from_timestamp(long long time) {
+	char* hhmmss = (char*)malloc(sizeof(char)*32);
+	int micros = (int)((time % NS_PER_SEC) / 1000);
+	long long seconds = time / NS_PER_SEC;
 	int num_precision = 3;
 	int time_segments[num_precision];
 	for(int i = 0; i < num_precision; i++) {
-		time_segments[i] = time % 60;
-		time /= 60;
+		time_segments[i] = seconds % 60;
+		seconds /= 60;
 	}
-	sprintf(hhmmss, "%02d:%02d:%02d", time_segments[2], time_segments[1], time_segments[0]);
+	time_segments[2] %= 24;
+	sprintf(hhmmss, "%02d:%02d:%02d.%06d", time_segments[2], time_segments[1], time_segments[0], micros);
 	return hhmmss;
 }
 
-void synchronize(int delta) {
-	TIMESTAMP += delta;
+// Whatever part of a slewed correction exceeds its measurement error is
+// drift since the last one. The bound is kept at twice the drift rate seen
+// in the last interval, and never below MIN_DRIFT_BOUND_PPB; it starts
+// out at DEFAULT_DRIFT_BOUND_PPB.
+void track_error(long long delta, long long error) {
+	long long now = monotonic_ns();
+	if(SYNC_TIME != 0 && llabs(delta) <= STEP_THRESHOLD_NS && now - SYNC_TIME >= 1000) {
+		long long drift = llabs(delta) - error;
+		long long rate_ppb = (drift > 0) ? drift * 1000000 / ((now - SYNC_TIME) / 1000) : 0;
+		DRIFT_BOUND_PPB = (2 * rate_ppb > MIN_DRIFT_BOUND_PPB) ? 2 * rate_ppb : MIN_DRIFT_BOUND_PPB;
+	}
+	SYNC_TIME = now;
+	SYNC_ERROR = error;
+}
+
+void publish_clock() {
+	struct ClockParams params;
+	params.drift_ppm = DRIFT_PPM;
+	params.slew_ppm = MAX_SLEW_PPM;
+	params.offset = CLOCK_OFFSET;
+	params.drift_start = DRIFT_START;
+	params.slew_remaining = SLEW_REMAINING;
+	params.slew_start = SLEW_START;
+	params.sync_time = SYNC_TIME;
+	params.sync_error = SYNC_ERROR;
+	params.drift_bound_ppb = DRIFT_BOUND_PPB;
+	clockPagePublish(CLOCK_PAGE, &params);
+}
+
+// Corrections past STEP_THRESHOLD_NS are stepped. Smaller ones are slewed in
+// at MAX_SLEW_PPM, so the clock neither jumps nor runs backwards. A new
+// delta replaces whatever of the last one is still pending, since the
+// master measured it against the clock as it reads now.
+void synchronize(long long delta) {
+	long long now = monotonic_ns();
+	CLOCK_OFFSET += slewed(now);
+	SLEW_START = now;
+	if(llabs(delta) > STEP_THRESHOLD_NS) {
+		CLOCK_OFFSET += delta;
+		SLEW_REMAINING = 0;
+	} else {
+		SLEW_REMAINING = delta;
+	}
 }
 
-// ./client SERVER_PORT CLIENT_OFFSET hh:mm:ss
+// ./client SERVER_PORT CLIENT_OFFSET hh:mm:ss|now [DRIFT_PPM]
 int main(int argc, char **argv) {
 	int server_port = (argc > 1) ? atoi(argv[1]) : (1<<13);
 	int port = (argc > 2) ? (server_port<<1)+atoi(argv[2]) : (server_port<<1);
-	TIMESTAMP = (argc > 3) ? convert_to_timestamp(argv[3]) : 0;
+	long long start_time = (argc > 3 && strcmp(argv[3], "now") != 0) ? convert_to_timestamp(argv[3]) : realtime_ns();
+	DRIFT_PPM = (argc > 4) ? atoi(argv[4]) : 0;
+	DRIFT_START = monotonic_ns();
+	CLOCK_OFFSET = start_time - DRIFT_START;
 	
 	int sock;
 	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -124,38 +290,54 @@ int main(int argc, char **argv) {
 		handle_error("bind()");
 	}
 
-	printf("Started client on port %d\n", port);
-
-	struct sockaddr_in server_addr;
-	memset(&server_addr, 0, sizeof(struct sockaddr_in));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = server_port;
-	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
-	printf("Current client time is %s\n", convert_from_timestamp(TIMESTAMP));
-
-	struct ClientMessage message;
-	if(waitForTimeRequest(sock, &message) < 0) {
-		handle_error("recv(SYN)");
-	}
-
-	assert(message.msg == SYN);
-
-	if(sendTimeResponse(sock, (struct sockaddr*)&server_addr) < 0) {
-		handle_error("sendto(SYNACK)");
+	// Receive timestamps are cheap, so they are always on; a SYN says
+	// whether to use them.
+	int enable = 1;
+	if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(int)) < 0) {
+		handle_error("setsockopt(SO_TIMESTAMPNS)");
 	}
 
-	if(waitForTimeUpdates(sock, &message) < 0) {
-		handle_error("recv(ACK)");
-	}
-
-	assert(message.msg == ACK);
+	printf("Started client on port %d\n", port);
 
-	printf("Received a delta of %d seconds\n", message.delta);
+	CLOCK_PAGE = clockPageCreate(port);
+	publish_clock();
 
-	synchronize(message.delta);
+	printf("Current client time is %s\n", convert_from_timestamp(local_time()));
 
-	printf("Time after synchronization is %s\n", convert_from_timestamp(TIMESTAMP));
+	// Serves the master's rounds until it sends FIN. A SYN is answered on
+	// whichever of the master's sockets it came from.
+	struct ClientMessage message;
+	do {
+		struct sockaddr_in server_addr;
+		long long received, kernel_received;
+		int len = waitForStampedMessage(sock, &message, &server_addr, &received, &kernel_received);
+		if(len < 0) {
+			handle_error("recv()");
+		}
+		if(len != CLIENT_DATA_LEN || message.version != PROTOCOL_VERSION) {
+			printf("Ignoring message of unknown version\n");
+			continue;
+		}
+
+		if(message.msg == SYN) {
+			if(sendTimeResponse(sock, (struct sockaddr*)&server_addr, message.round,
+					((message.flags & KERNEL_TIMESTAMPS_FLAG) && kernel_received != 0) ? kernel_received : received) < 0) {
+				handle_error("sendto(SYNACK)");
+			}
+		} else if(message.msg == ACK) {
+			printf("Received a delta of %.3f us, %s it\n", message.delta / 1000.0,
+					(llabs(message.delta) > STEP_THRESHOLD_NS) ? "stepping" : "slewing");
+
+			synchronize(message.delta);
+			track_error(message.delta, message.error);
+			publish_clock();
+
+			printf("Time after synchronization is %s, error bound %.3f us, drift bound %.1f ppm\n",
+					convert_from_timestamp(local_time()), SYNC_ERROR / 1000.0, DRIFT_BOUND_PPB / 1000.0);
+		}
+	} while(message.msg != FIN);
+
+	clockPageDestroy(CLOCK_PAGE, port);
 
 	close(sock);
 
@@ -0,0 +1,217 @@
+#ifndef CLOCK_PAGE_H
+#define CLOCK_PAGE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Shared-memory page through which a Berkeley client daemon publishes its
+// synchronized clock to the other processes on the host. The clock is
+// CLOCK_MONOTONIC plus offset, plus drift_ppm of the time since
+// drift_start, plus slew_remaining slewed in at slew_ppm since slew_start,
+// which is exactly what the daemon computes for itself. A reader
+// recomputes it from CLOCK_MONOTONIC, a vDSO call, so reading the
+// synchronized time costs no syscall and no round trip to the daemon.
+//
+// The daemon also publishes how wrong that time may be: the error bound
+// the master sent with the last correction, the time of that correction,
+// and a bound on how fast the clock drifts. clockPageNow turns them into an
+// earliest/latest interval that the synchronized time is certain to lie
+// in, TrueTime-style, and clockPageCommitWait waits out a timestamp's
+// uncertainty so that events can be ordered by their timestamps alone.
+//
+// The parameters are guarded by a seqlock: the daemon makes seq odd while
+// it rewrites them, and a reader retries if seq was odd or moved while it
+// was copying them.
+
+#define CLOCK_PAGE_NAME_LEN 64
+#define CLOCK_UNSYNCHRONIZED_WAIT_NS 1000000
+
+struct ClockPage {
+    unsigned int seq;
+    int drift_ppm;
+    int slew_ppm;
+    int reserved;
+    long long offset;
+    long long drift_start;
+    long long slew_remaining;
+    long long slew_start;
+    long long sync_time;
+    long long sync_error;
+    long long drift_bound_ppb;
+};
+
+struct ClockParams {
+    int drift_ppm;
+    int slew_ppm;
+    long long offset;
+    long long drift_start;
+    long long slew_remaining;
+    long long slew_start;
+    long long sync_time;
+    long long sync_error;
+    long long drift_bound_ppb;
+};
+
+struct ClockInterval {
+    long long earliest;
+    long long latest;
+};
+
+static inline void clockPageName(char* name, int port) {
+    snprintf(name, CLOCK_PAGE_NAME_LEN, "/berkeley_clock_%d", port);
+}
+
+static inline struct ClockPage* clockPageMap(int port, int writable) {
+    char name[CLOCK_PAGE_NAME_LEN];
+    clockPageName(name, port);
+    int fd = shm_open(name, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(writable && ftruncate(fd, sizeof(struct ClockPage)) < 0) {
+        perror("ftruncate(clock page)");
+        exit(EXIT_FAILURE);
+    }
+    void* page = mmap(NULL, sizeof(struct ClockPage), writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(page == MAP_FAILED) {
+        perror("mmap(clock page)");
+        exit(EXIT_FAILURE);
+    }
+    return (struct ClockPage*)page;
+}
+
+// Creates the page of the client daemon bound to port.
+static inline struct ClockPage* clockPageCreate(int port) {
+    struct ClockPage* page = clockPageMap(port, 1);
+    if(page == NULL) {
+        perror("shm_open(clock page)");
+        exit(EXIT_FAILURE);
+    }
+    return page;
+}
+
+static inline void clockPagePublish(struct ClockPage* page, struct ClockParams* params) {
+    unsigned int seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&page->drift_ppm, params->drift_ppm, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->slew_ppm, params->slew_ppm, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->offset, params->offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->drift_start, params->drift_start, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->slew_remaining, params->slew_remaining, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->slew_start, params->slew_start, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->sync_time, params->sync_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->sync_error, params->sync_error, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->drift_bound_ppb, params->drift_bound_ppb, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline void clockPageDestroy(struct ClockPage* page, int port) {
+    char name[CLOCK_PAGE_NAME_LEN];
+    clockPageName(name, port);
+    munmap(page, sizeof(struct ClockPage));
+    shm_unlink(name);
+}
+
+// Maps the page of the client daemon bound to port read-only, or returns
+// NULL if that daemon is not running.
+static inline struct ClockPage* clockPageOpen(int port) {
+    return clockPageMap(port, 0);
+}
+
+static inline void clockPageClose(struct ClockPage* page) {
+    munmap(page, sizeof(struct ClockPage));
+}
+
+static inline void clockPageSnapshot(struct ClockPage* page, struct ClockParams* params) {
+    unsigned int seq;
+    do {
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        params->drift_ppm = __atomic_load_n(&page->drift_ppm, __ATOMIC_RELAXED);
+        params->slew_ppm = __atomic_load_n(&page->slew_ppm, __ATOMIC_RELAXED);
+        params->offset = __atomic_load_n(&page->offset, __ATOMIC_RELAXED);
+        params->drift_start = __atomic_load_n(&page->drift_start, __ATOMIC_RELAXED);
+        params->slew_remaining = __atomic_load_n(&page->slew_remaining, __ATOMIC_RELAXED);
+        params->slew_start = __atomic_load_n(&page->slew_start, __ATOMIC_RELAXED);
+        params->sync_time = __atomic_load_n(&page->sync_time, __ATOMIC_RELAXED);
+        params->sync_error = __atomic_load_n(&page->sync_error, __ATOMIC_RELAXED);
+        params->drift_bound_ppb = __atomic_load_n(&page->drift_bound_ppb, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+}
+
+static inline long long clockParamsSlewed(struct ClockParams* params, long long now) {
+    long long applied = (now - params->slew_start) * params->slew_ppm / 1000000;
+    if(applied >= llabs(params->slew_remaining)) {
+        return params->slew_remaining;
+    }
+    return (params->slew_remaining < 0) ? -applied : applied;
+}
+
+// Synchronized time in nanoseconds at monotonic time now.
+static inline long long clockParamsTime(struct ClockParams* params, long long now) {
+    return now + (now - params->drift_start) * params->drift_ppm / 1000000 + params->offset + clockParamsSlewed(params, now);
+}
+
+// The last sync's error grows by the drift bound for every nanosecond
+// since. The part of the last correction still to be slewed in is a known
+// error, so it only widens the interval on the side the clock will move.
+// Before the first sync nothing is known and the interval is unbounded.
+static inline struct ClockInterval clockParamsInterval(struct ClockParams* params, long long now) {
+    struct ClockInterval interval;
+    if(params->sync_time == 0) {
+        interval.earliest = LLONG_MIN;
+        interval.latest = LLONG_MAX;
+        return interval;
+    }
+    long long time = clockParamsTime(params, now);
+    long long error = params->sync_error + (now - params->sync_time) / 1000 * params->drift_bound_ppb / 1000000;
+    long long pending = params->slew_remaining - clockParamsSlewed(params, now);
+    interval.earliest = time - error + ((pending < 0) ? pending : 0);
+    interval.latest = time + error + ((pending > 0) ? pending : 0);
+    return interval;
+}
+
+static inline long long clockPageMonotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline long long clockPageRead(struct ClockPage* page) {
+    struct ClockParams params;
+    clockPageSnapshot(page, &params);
+    return clockParamsTime(&params, clockPageMonotonic());
+}
+
+static inline struct ClockInterval clockPageNow(struct ClockPage* page) {
+    struct ClockParams params;
+    clockPageSnapshot(page, &params);
+    return clockParamsInterval(&params, clockPageMonotonic());
+}
+
+// Returns once timestamp is certainly in the past on every synchronized
+// clock, i.e. once the earliest the time can be is past it. A transaction
+// that commits at now().latest and waits this out before its effects
+// become visible is ordered after everything that was visible when it
+// started.
+static inline void clockPageCommitWait(struct ClockPage* page, long long timestamp) {
+    for(;;) {
+        struct ClockInterval interval = clockPageNow(page);
+        if(interval.earliest > timestamp) {
+            return;
+        }
+        long long wait = (interval.earliest == LLONG_MIN) ? CLOCK_UNSYNCHRONIZED_WAIT_NS : timestamp - interval.earliest + 1;
+        struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+        nanosleep(&ts, NULL);
+    }
+}
+
+#endif
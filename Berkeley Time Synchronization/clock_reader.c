@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "clock_page.h"
+
+#define NS_PER_SEC 1000000000LL
+
+long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// ./clock_reader CLIENT_PORT [NUM_READS]
+// Prints the synchronized time published by the client daemon bound to
+// CLIENT_PORT with its uncertainty and how long a commit wait takes, then
+// times NUM_READS reads of it against plain clock_gettime(CLOCK_MONOTONIC).
+int main(int argc, char **argv) {
+	int port = (argc > 1) ? atoi(argv[1]) : (1<<14)+1;
+	int num_reads = (argc > 2) ? atoi(argv[2]) : 10000000;
+
+	struct ClockPage* page = clockPageOpen(port);
+	if(page == NULL) {
+		fprintf(stderr, "No clock published for port %d\n", port);
+		exit(EXIT_FAILURE);
+	}
+
+	long long time = clockPageRead(page);
+	long long seconds = time / NS_PER_SEC;
+	struct ClockInterval interval = clockPageNow(page);
+	if(interval.earliest == LLONG_MIN) {
+		printf("Synchronized time is %02lld:%02lld:%02lld.%06lld, not synchronized yet\n", (seconds / 3600) % 24,
+				(seconds / 60) % 60, seconds % 60, (time % NS_PER_SEC) / 1000);
+	} else {
+		printf("Synchronized time is %02lld:%02lld:%02lld.%06lld +/- %.3f us\n", (seconds / 3600) % 24, (seconds / 60) % 60,
+				seconds % 60, (time % NS_PER_SEC) / 1000, (interval.latest - interval.earliest) / 2000.0);
+
+		// Commit wait for a timestamp taken now: how long until it is certainly past.
+		long long start = monotonic_ns();
+		clockPageCommitWait(page, clockPageNow(page).latest);
+		printf("Commit wait took %.3f us\n", (monotonic_ns() - start) / 1000.0);
+	}
+
+	long long sink = 0;
+	long long start = monotonic_ns();
+	for(int i = 0; i < num_reads; i++) {
+		sink += clockPageRead(page);
+	}
+	long long page_ns = monotonic_ns() - start;
+
+	start = monotonic_ns();
+	for(int i = 0; i < num_reads; i++) {
+		sink += monotonic_ns();
+	}
+	long long monotonic_total_ns = monotonic_ns() - start;
+
+	printf("clockPageRead %.1f ns/read, clock_gettime %.1f ns/read (%lld)\n", (double)page_ns / num_reads,
+			(double)monotonic_total_ns / num_reads, sink & 1);
+
+	clockPageClose(page);
+
+	return 0;
+}
@@ -4,52 +4,269 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
 #define PORT ((1<<13)+5)
 #define CLIENT_DATA_LEN sizeof(struct ClientMessage)
 #define REQ_LEN sizeof(struct ClientMessage)
+#define ROUND_TIMEOUT_MS 1000
+#define PROTOCOL_VERSION 5
+#define NS_PER_SEC 1000000000LL
+#define FIXED_FRAC_BITS 16
+#define MAX_SLEW_PPM 500
+#define STEP_THRESHOLD_NS 128000000LL
+#define MIN_POLL_MS 250
+#define MAX_POLL_MS 64000
+#define DEFAULT_SKEW_BOUND_US 1000
+#define KERNEL_TIMESTAMPS_FLAG 1
+#define CONTROL_LEN 256
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {SYN, SYNACK, ACK};
-
-int TIMESTAMP;
-
+enum MSG_TYPE {SYN, SYNACK, ACK, FIN};
+
+// The clock is CLOCK_MONOTONIC shifted by CLOCK_OFFSET nanoseconds, so it
+// keeps running between rounds and a correction never makes it step back
+// through the kernel's own clock. SLEW_REMAINING is the part of the last
+// correction still being slewed in since SLEW_START.
+long long CLOCK_OFFSET;
+long long SLEW_REMAINING;
+long long SLEW_START;
+
+// With -k the socket reports kernel receive and transmit timestamps, so the
+// time spent waking up and in the syscalls stays out of every RTT. Sends
+// are counted to match transmit timestamps, which carry the send's index.
+int KERNEL_TIMESTAMPS;
+unsigned int NUM_SENDS;
+
+// A SYNACK's time is the clock when the SYN arrived and hold how long the
+// SYN was held before the SYNACK left. A SYN flagged KERNEL_TIMESTAMPS_FLAG
+// asks for that arrival to be the kernel's receive timestamp.
+//
+// Version 5 adds a SYNACK's low and high: how far the slowest and fastest
+// clock in a sub-master's subtree are from the time it reports, so the
+// root sees the spread of every clock rather than of its children's means.
+// A client's are 0. Version 4 added an ACK's error: how far the corrected
+// clock may be from the synchronized time right after the delta is
+// applied. Version 3 added
+// what a sub-master needs to stand in for its subtree: count is the number
+// of clocks a SYNACK's time averages, hold also covers polling the
+// subtree, and budget_ms is how long a SYN's receiver may poll its own
+// subtree. Version 2 carried nanosecond clock readings and deltas.
+// Version 1 had no version field and counted whole seconds.
 struct ClientMessage {
 	int flags;
-	int time;
-	int delta;
+	int version;
 	enum MSG_TYPE msg;
+	int round;
+	long long time;
+	long long delta;
+	long long hold;
+	int count;
+	int budget_ms;
+	long long error;
+	long long low;
+	long long high;
 };
 
+long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+long long realtime_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+long long slewed(long long now) {
+	long long applied = (now - SLEW_START) * MAX_SLEW_PPM / 1000000;
+	if(applied >= llabs(SLEW_REMAINING)) {
+		return SLEW_REMAINING;
+	}
+	return (SLEW_REMAINING < 0) ? -applied : applied;
+}
+
+long long local_time_at(long long now) {
+	return now + CLOCK_OFFSET + slewed(now);
+}
+
+long long local_time() {
+	return local_time_at(monotonic_ns());
+}
+
+// Kernel timestamps are CLOCK_REALTIME. They are moved onto CLOCK_MONOTONIC
+// by the distance between the two clocks now, which is only off if
+// CLOCK_REALTIME was stepped in between.
+long long kernel_to_monotonic(struct timespec* ts) {
+	long long stamp = (long long)ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+	return stamp - (realtime_ns() - monotonic_ns());
+}
+
+void enable_kernel_timestamps(int sock) {
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+			SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		handle_error("setsockopt(SO_TIMESTAMPING)");
+	}
+	KERNEL_TIMESTAMPS = 1;
+	NUM_SENDS = 0;
+}
+
+// Returns the software timestamp among msg's control messages as
+// CLOCK_MONOTONIC, or 0 if there is none.
+long long get_kernel_timestamp(struct msghdr* msg) {
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping* stamps = (struct scm_timestamping*)CMSG_DATA(cmsg);
+			if(stamps->ts[0].tv_sec != 0 || stamps->ts[0].tv_nsec != 0) {
+				return kernel_to_monotonic(&stamps->ts[0]);
+			}
+		}
+	}
+	return 0;
+}
+
+// Reads one transmit timestamp off the error queue, storing the index of
+// the send it belongs to. Returns 0 once the queue is empty.
+long long get_transmit_timestamp(int sock, unsigned int* send_index) {
+	char control[CONTROL_LEN];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_control = control;
+	msg.msg_controllen = CONTROL_LEN;
+	if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+		return 0;
+	}
+	*send_index = 0;
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+			struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+			if(err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+				*send_index = err->ee_data;
+			}
+		}
+	}
+	long long stamp = get_kernel_timestamp(&msg);
+	return (stamp != 0) ? stamp : -1;
+}
+
+// Empties the error queue, storing the transmit timestamp of each of this
+// round's SYNs in sent_at and marking it in stamped. first_send is the
+// index of the round's first SYN.
+void drain_transmit_timestamps(int sock, unsigned int first_send, int num_clients, long long* sent_at, int* stamped) {
+	unsigned int send_index;
+	long long stamp;
+	while((stamp = get_transmit_timestamp(sock, &send_index)) != 0) {
+		unsigned int j = send_index - first_send;
+		if(stamp > 0 && j < (unsigned int)num_clients) {
+			sent_at[j] = stamp;
+			stamped[j] = 1;
+		}
+	}
+}
+
+// Corrections past STEP_THRESHOLD_NS are stepped. Smaller ones are slewed in
+// at MAX_SLEW_PPM, so the clock neither jumps nor runs backwards. A new
+// delta replaces whatever of the last one is still pending, since it was
+// measured against the clock as it reads now.
+void adjust_clock(long long delta) {
+	long long now = monotonic_ns();
+	CLOCK_OFFSET += slewed(now);
+	SLEW_START = now;
+	if(llabs(delta) > STEP_THRESHOLD_NS) {
+		CLOCK_OFFSET += delta;
+		SLEW_REMAINING = 0;
+	} else {
+		SLEW_REMAINING = delta;
+	}
+}
+
+void initMessage(struct ClientMessage* message, enum MSG_TYPE msg) {
+	memset(message, 0, CLIENT_DATA_LEN);
+	message->version = PROTOCOL_VERSION;
+	message->msg = msg;
+}
+
 int sendResponse(int sock, struct ClientMessage* resp, struct sockaddr* addr) {
-	return sendto(sock, resp, CLIENT_DATA_LEN, 0, addr, sizeof(struct sockaddr));
+	int len = sendto(sock, resp, CLIENT_DATA_LEN, 0, addr, sizeof(struct sockaddr));
+	if(len >= 0) {
+		NUM_SENDS++;
+	}
+	return len;
 }
 
 int sendStatusResponse(enum MSG_TYPE msg, int sock, struct sockaddr* addr) {
 	struct ClientMessage resp;
-	resp.msg = msg;
+	initMessage(&resp, msg);
 	return sendResponse(sock, &resp, addr);
 }
 
-int sendTimeRequest(int sock, struct sockaddr* addr) {
-	return sendStatusResponse(SYN, sock, addr);
+int sendTimeRequest(int sock, struct sockaddr* addr, int round, int budget_ms) {
+	struct ClientMessage req;
+	initMessage(&req, SYN);
+	req.round = round;
+	req.budget_ms = budget_ms;
+	if(KERNEL_TIMESTAMPS) {
+		req.flags |= KERNEL_TIMESTAMPS_FLAG;
+	}
+	return sendResponse(sock, &req, addr);
 }
 
-int getTimeResponse(int sock, struct ClientMessage* resp) {
-	return recv(sock, resp, sizeof(struct ClientMessage), 0);
+int sendSubtreeTime(int sock, struct sockaddr* addr, int round, long long time, int count, long long hold,
+		long long low, long long high) {
+	struct ClientMessage resp;
+	initMessage(&resp, SYNACK);
+	resp.round = round;
+	resp.time = time;
+	resp.count = count;
+	resp.hold = hold;
+	resp.low = low;
+	resp.high = high;
+	return sendResponse(sock, &resp, addr);
 }
 
-int sendTimeUpdates(int sock, struct sockaddr* addr, int delta) {
+// Also stores when the message arrived: the kernel's receive timestamp with
+// -k, otherwise the time recvmsg returned.
+int getTimeResponse(int sock, struct ClientMessage* resp, struct sockaddr_in* addr, socklen_t* addrlen, long long* received) {
+	char control[CONTROL_LEN];
+	struct iovec iov = {resp, sizeof(struct ClientMessage)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_name = addr;
+	msg.msg_namelen = *addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CONTROL_LEN;
+	int len = recvmsg(sock, &msg, 0);
+	*received = monotonic_ns();
+	*addrlen = msg.msg_namelen;
+	if(len >= 0 && KERNEL_TIMESTAMPS) {
+		long long stamp = get_kernel_timestamp(&msg);
+		if(stamp != 0) {
+			*received = stamp;
+		}
+	}
+	return len;
+}
+
+int sendTimeUpdates(int sock, struct sockaddr* addr, long long delta, long long error) {
 	struct ClientMessage resp;
-	resp.msg = ACK;
+	initMessage(&resp, ACK);
 	resp.delta = delta;
+	resp.error = error;
 	return sendResponse(sock, &resp, addr);
 }
 
@@ -62,96 +279,271 @@ void reportAck(int sock, struct sockaddr* addr) {
 void handleClientRequest(int sock, struct ClientMessage* client_req, struct sockaddr* addr) {
 	enum MSG_TYPE msg = client_req->msg;
 	printf("%d\n", msg);
-	int time = client_req->time;
+	long long time = client_req->time;
 	int flags = client_req->flags;
 	int client_port = ((struct sockaddr_in*)addr)->sin_port;
 }
 
-int convert_to_timestamp(char* hhmmss) {
+// Nanoseconds since midnight.
+long long convert_to_timestamp(char* hhmmss) {
 	assert(strlen(hhmmss) == 8);
-	char hh[3], mm[3], ss[3];
+	char hh[3] = {0}, mm[3] = {0}, ss[3] = {0};
 	strncpy(hh, hhmmss, 2);
 	strncpy(mm, hhmmss+3, 2);
 	strncpy(ss, hhmmss+6, 2);
 	int hours = atoi(hh);
 	int minutes = atoi(mm);
 	int seconds = atoi(ss);
-	return hours*60*60+minutes*60+seconds;
+	return (hours*60*60+minutes*60+seconds) * NS_PER_SEC;
 }
 
 char* to_string(int time) {
-	char* strtime = (char*)malloc(sizeof(char)*2);
+	char* strtime = (char*)malloc(sizeof(char)*3);
 	sprintf(strtime, "%02d", time);
 	return strtime;
 }
 
-char* convert_from_timestamp(int time) {
-	char* hhmmss = (char*)malloc(sizeof(char)*8);
+// Time of day as hh:mm:ss.uuuuuu.
+char* convert_from_timestamp(long long time) {
+	char* hhmmss = (char*)malloc(sizeof(char)*32);
+	int micros = (int)((time % NS_PER_SEC) / 1000);
+	long long seconds = time / NS_PER_SEC;
 	int num_precision = 3;
 	int time_segments[num_precision];
 	for(int i = 0; i < num_precision; i++) {
-		time_segments[i] = time % 60;
-		time /= 60;
+		time_segments[i] = seconds % 60;
+		seconds /= 60;
 	}
-	sprintf(hhmmss, "%02d:%02d:%02d", time_segments[2], time_segments[1], time_segments[0]);
+	time_segments[2] %= 24;
+	sprintf(hhmmss, "%02d:%02d:%02d.%06d", time_segments[2], time_segments[1], time_segments[0], micros);
 	return hhmmss;
 }
 
-int* collect_client_timestamps(int sock, int num_clients, struct sockaddr** client_addrs) {
+int find_client(int num_clients, struct sockaddr** client_addrs, struct sockaddr_in* addr) {
+	for(int i = 0; i < num_clients; i++) {
+		if(((struct sockaddr_in*)client_addrs[i])->sin_port == addr->sin_port) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Sends every SYN before reading any reply, so a round takes about one RTT
+// instead of the sum of them. Each reading was taken somewhere within its
+// round trip, so it is moved forward by half the RTT (Cristian's estimate)
+// and compared with the master's clock on arrival. A sub-master's reply
+// stands for counts[i] clocks, and the time it held the SYN is taken out of
+// its RTT. With -k the RTT runs from the kernel's transmit timestamp of the
+// SYN to its receive timestamp of the SYNACK. Each RTT, less the hold, is
+// stored in rtts[i]: the reading is off by at most half of it, and the
+// spread of a sub-master's subtree around its reading in lows[i] and
+// highs[i]. Returns each client's offset from the master in nanoseconds.
+// Clients silent for timeout_ms are left out of the round, and a late
+// SYNACK from an earlier round is recognized by its round number and
+// dropped.
+long long* collect_client_offsets(int sock, int round, int timeout_ms, int num_clients, struct sockaddr** client_addrs,
+		int* responded, int* counts, long long* rtts, long long* lows, long long* highs) {
 	struct ClientMessage client_resp;
-	int* client_timestamps = (int*)malloc(sizeof(int)*num_clients);
+	long long* client_offsets = (long long*)calloc(num_clients, sizeof(long long));
+	long long* sent_at = (long long*)malloc(sizeof(long long)*num_clients);
+	int* stamped = (int*)calloc(num_clients, sizeof(int));
+
+	// Transmit timestamps of earlier ACKs and FINs are of no use any more.
+	unsigned int send_index;
+	while(KERNEL_TIMESTAMPS && get_transmit_timestamp(sock, &send_index) != 0);
+	unsigned int first_send = NUM_SENDS;
 
 	for(int i = 0; i < num_clients; i++) {
 		printf("Sending SYN request to client %d\n", ((struct sockaddr_in*)client_addrs[i])->sin_port);
 
-		if(sendTimeRequest(sock, client_addrs[i]) < 0) {
+		responded[i] = 0;
+		counts[i] = 0;
+		sent_at[i] = monotonic_ns();
+		if(sendTimeRequest(sock, client_addrs[i], round, timeout_ms / 2) < 0) {
 			handle_error("sendto(SYN)");
 		}
+	}
 
-		if(getTimeResponse(sock, &client_resp) < 0) {
+	long long start = monotonic_ns();
+	long long deadline = start + timeout_ms * 1000000LL;
+	int num_responses = 0;
+	while(num_responses < num_clients) {
+		long long now = monotonic_ns();
+		if(now >= deadline) {
+			break;
+		}
+		struct pollfd pfd = {sock, POLLIN, 0};
+		if(poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) < 0) {
+			handle_error("poll()");
+		}
+		// Queued transmit timestamps raise POLLERR until they are read, so
+		// they are taken off the error queue here or poll would spin.
+		if(pfd.revents & POLLERR) {
+			drain_transmit_timestamps(sock, first_send, num_clients, sent_at, stamped);
+		}
+		if(!(pfd.revents & POLLIN)) {
+			continue;
+		}
+
+		struct sockaddr_in client_addr;
+		socklen_t addrlen = sizeof(struct sockaddr_in);
+		long long arrival;
+		int len = getTimeResponse(sock, &client_resp, &client_addr, &addrlen, &arrival);
+		if(len < 0) {
 			handle_error("recv(SYNACK)");
 		}
 
-		assert(client_resp.msg == SYNACK);
+		if(len != CLIENT_DATA_LEN || client_resp.version != PROTOCOL_VERSION) {
+			printf("Ignoring message of unknown version from client %d\n", client_addr.sin_port);
+			continue;
+		}
+		int i = find_client(num_clients, client_addrs, &client_addr);
+		if(i < 0 || responded[i] || client_resp.msg != SYNACK || client_resp.round != round) {
+			continue;
+		}
 
-		client_timestamps[i] = client_resp.time;
+		// A SYN's transmit timestamp is queued before its SYNACK can come back.
+		if(KERNEL_TIMESTAMPS && !stamped[i]) {
+			drain_transmit_timestamps(sock, first_send, num_clients, sent_at, stamped);
+		}
 
-		printf("Received SYNACK response from client %d having time %s\n",
-				((struct sockaddr_in*)client_addrs[i])->sin_port, convert_from_timestamp(client_resp.time));
+		long long rtt = arrival - sent_at[i] - client_resp.hold;
+		rtts[i] = rtt;
+		client_offsets[i] = client_resp.time + client_resp.hold + rtt / 2 - local_time_at(arrival);
+		counts[i] = (client_resp.count > 0) ? client_resp.count : 1;
+		lows[i] = client_resp.low;
+		highs[i] = client_resp.high;
+		responded[i] = 1;
+		num_responses++;
+
+		printf("Received SYNACK response from client %d having time %s (RTT %.3f us)\n",
+				client_addr.sin_port, convert_from_timestamp(client_resp.time), rtt / 1000.0);
 	}
 
-	return client_timestamps;
+	printf("Collected %d of %d clock readings in %.3f ms\n", num_responses, num_clients, (monotonic_ns() - start) / 1e6);
+
+	free(sent_at);
+	free(stamped);
+	return client_offsets;
 }
 
-int synchronize_time(int* client_timestamps, int num_clients) {
-	int time_sum = TIMESTAMP;
+// Mean offset of every clock that answered, the master's own being 0, in
+// fixed point with FIXED_FRAC_BITS fractional bits. A sub-master's offset
+// is its subtree's mean and weighs as many clocks as the subtree holds.
+// The division would otherwise truncate toward zero and drag every round's
+// mean the same way. The result holds offsets of up to 2^47 ns, about a
+// day and a half.
+long long synchronize_offset(long long* client_offsets, int* responded, int* counts, int num_clients, int* num_clocks) {
+	__int128 offset_sum = 0;
+	*num_clocks = 1;
 	for(int i = 0; i < num_clients; i++) {
-		time_sum += client_timestamps[i];
+		if(responded[i]) {
+			offset_sum += ((__int128)client_offsets[i] << FIXED_FRAC_BITS) * counts[i];
+			*num_clocks += counts[i];
+		}
 	}
-	return time_sum / (num_clients + 1);
+	return (long long)(offset_sum / *num_clocks);
 }
 
-int calculate_delta(int synchronized_time, int timestamp) {
-	return synchronized_time - timestamp;
+// Rounds a fixed-point difference to the nearest nanosecond.
+long long calculate_delta(long long synchronized_offset, long long offset) {
+	__int128 diff = synchronized_offset - ((__int128)offset << FIXED_FRAC_BITS);
+	__int128 half = 1 << (FIXED_FRAC_BITS - 1);
+	return (long long)((diff >= 0) ? (diff + half) >> FIXED_FRAC_BITS : -((-diff + half) >> FIXED_FRAC_BITS));
 }
 
-int* calculate_client_deltas(int synchronized_time, int* client_timestamps, int num_clients) {
-	int* client_deltas = (int*)malloc(sizeof(int)*num_clients);
+long long* calculate_client_deltas(long long synchronized_offset, long long* client_offsets, int num_clients) {
+	long long* client_deltas = (long long*)malloc(sizeof(long long)*num_clients);
 	for(int i = 0; i < num_clients; i++) {
-		client_deltas[i] = calculate_delta(synchronized_time, client_timestamps[i]);
+		client_deltas[i] = calculate_delta(synchronized_offset, client_offsets[i]);
 	}
 	return client_deltas;
 }
 
-int send_deltas(int sock, int num_clients, struct sockaddr** client_addrs, int* client_deltas) {
+// Picks the next polling interval so that the drift seen over this one
+// would use up half of SKEW_BOUND_US: it backs off while the clocks stay
+// close and tightens as they drift apart, but at most by a factor of two
+// per round so that one noisy reading cannot swing it.
+int next_poll_interval(int interval_ms, double skew_us, int skew_bound_us) {
+	long long next_ms = (skew_us > 0) ? (long long)(interval_ms * (skew_bound_us / 2.0) / skew_us) : interval_ms * 2LL;
+	if(next_ms > interval_ms * 2LL) {
+		next_ms = interval_ms * 2LL;
+	}
+	if(next_ms < interval_ms / 2) {
+		next_ms = interval_ms / 2;
+	}
+	if(next_ms < MIN_POLL_MS) {
+		next_ms = MIN_POLL_MS;
+	}
+	if(next_ms > MAX_POLL_MS) {
+		next_ms = MAX_POLL_MS;
+	}
+	return (int)next_ms;
+}
+
+// Offsets of the slowest and fastest clock that answered from the master,
+// the master included, reaching down into each sub-master's subtree.
+void measure_offset_range(long long* client_offsets, long long* lows, long long* highs, int* responded, int num_clients,
+		long long* min_offset, long long* max_offset) {
+	*min_offset = 0;
+	*max_offset = 0;
 	for(int i = 0; i < num_clients; i++) {
-		if(sendTimeUpdates(sock, client_addrs[i], client_deltas[i]) < 0) {
+		if(!responded[i]) {
+			continue;
+		}
+		if(client_offsets[i] + lows[i] < *min_offset) {
+			*min_offset = client_offsets[i] + lows[i];
+		}
+		if(client_offsets[i] + highs[i] > *max_offset) {
+			*max_offset = client_offsets[i] + highs[i];
+		}
+	}
+}
+
+// Spread between the fastest and slowest clock that answered, master included.
+double measure_skew_us(long long* client_offsets, long long* lows, long long* highs, int* responded, int num_clients) {
+	long long min_offset, max_offset;
+	measure_offset_range(client_offsets, lows, highs, responded, num_clients, &min_offset, &max_offset);
+	return (max_offset - min_offset) / 1000.0;
+}
+
+// How far the mean may be off: each clock's reading is off by up to half
+// its RTT, weighted as in the mean itself.
+long long synchronization_error(long long* rtts, int* responded, int* counts, int num_clients, int num_clocks) {
+	long long error_sum = 0;
+	for(int i = 0; i < num_clients; i++) {
+		if(responded[i]) {
+			error_sum += rtts[i] / 2 * counts[i];
+		}
+	}
+	return error_sum / num_clocks;
+}
+
+// A client corrected by its delta is off from the synchronized time by its
+// own reading's error plus the mean's, on top of base_error, which is how
+// far this master's notion of the synchronized time may itself be off.
+int send_deltas(int sock, int num_clients, struct sockaddr** client_addrs, long long* client_deltas, int* responded,
+		long long* rtts, long long base_error) {
+	for(int i = 0; i < num_clients; i++) {
+		if(!responded[i]) {
+			continue;
+		}
+		if(sendTimeUpdates(sock, client_addrs[i], client_deltas[i], base_error + rtts[i] / 2) < 0) {
 			handle_error("sendto(ACK)");
 		}
 	}
 	return 0;
 }
 
+int send_fins(int sock, int num_clients, struct sockaddr** client_addrs) {
+	for(int i = 0; i < num_clients; i++) {
+		if(sendStatusResponse(FIN, sock, client_addrs[i]) < 0) {
+			handle_error("sendto(FIN)");
+		}
+	}
+	return 0;
+}
+
 struct sockaddr_in* get_new_sockaddr() {
 	struct sockaddr_in* addr = (struct sockaddr_in*)malloc(sizeof(struct sockaddr));
 	socklen_t addrlen = sizeof(struct sockaddr);
@@ -167,9 +559,105 @@ struct sockaddr_in* create_sockaddr(int port) {
 	return addr;
 }
 
-// ./server hh:mm:ss p1 p2 p3 p4 ... pn
+// A sub-master answers its parent's SYN by polling its own subtree, within
+// the budget the SYN grants, and reporting its subtree's mean clock and
+// size as if it were one client, along with how far its slowest and
+// fastest clock are from that mean. The delta that comes back moves that
+// mean, so each clock below it is sent the same delta plus its own
+// distance from the mean. Each level costs one more round trip, so a
+// round over N clocks takes O(log N) of them, and no node talks to more
+// than its own children.
+void run_submaster(int sock, int parent_port, int num_clients, struct sockaddr** client_addrs) {
+	int responded[num_clients];
+	int counts[num_clients];
+	long long rtts[num_clients];
+	long long lows[num_clients];
+	long long highs[num_clients];
+	long long* client_offsets = NULL;
+	long long synchronized_offset = 0;
+	long long mean_error = 0;
+	int round = 0;
+
+	printf("Serving as sub-master under port %d\n", parent_port);
+
+	struct ClientMessage message;
+	do {
+		struct sockaddr_in parent_addr;
+		socklen_t addrlen = sizeof(struct sockaddr_in);
+		long long received;
+		int len = getTimeResponse(sock, &message, &parent_addr, &addrlen, &received);
+		if(len < 0) {
+			handle_error("recv()");
+		}
+		// Stray SYNACKs from children that answered too late are dropped here.
+		if(parent_addr.sin_port != parent_port || len != CLIENT_DATA_LEN || message.version != PROTOCOL_VERSION) {
+			continue;
+		}
+
+		if(message.msg == SYN) {
+			round = message.round;
+			free(client_offsets);
+			client_offsets = collect_client_offsets(sock, round, message.budget_ms, num_clients, client_addrs, responded, counts, rtts,
+					lows, highs);
+
+			int num_clocks;
+			synchronized_offset = synchronize_offset(client_offsets, responded, counts, num_clients, &num_clocks);
+			mean_error = synchronization_error(rtts, responded, counts, num_clients, num_clocks);
+
+			long long mean_offset = calculate_delta(synchronized_offset, 0);
+			long long min_offset, max_offset;
+			measure_offset_range(client_offsets, lows, highs, responded, num_clients, &min_offset, &max_offset);
+
+			printf("Round %d: subtree of %d clocks, skew %.3f us\n", round, num_clocks, (max_offset - min_offset) / 1000.0);
+
+			long long subtree_time = local_time_at(received) + mean_offset;
+			if(sendSubtreeTime(sock, (struct sockaddr*)&parent_addr, round, subtree_time, num_clocks, monotonic_ns() - received,
+					min_offset - mean_offset, max_offset - mean_offset) < 0) {
+				handle_error("sendto(SYNACK)");
+			}
+		} else if(message.msg == ACK && client_offsets != NULL) {
+			long long subtree_offset = synchronized_offset + message.delta * (1LL << FIXED_FRAC_BITS);
+			long long* client_deltas = calculate_client_deltas(subtree_offset, client_offsets, num_clients);
+			if(send_deltas(sock, num_clients, client_addrs, client_deltas, responded, rtts, message.error + mean_error)) {
+				exit(EXIT_FAILURE);
+			}
+			adjust_clock(calculate_delta(subtree_offset, 0));
+			free(client_deltas);
+		}
+	} while(message.msg != FIN);
+
+	free(client_offsets);
+}
+
+// ./server [-n ROUNDS] [-b SKEW_BOUND_US] [-l PORT] [-u PARENT_PORT] [-k] hh:mm:ss|now p1 p2 p3 p4 ... pn
+// Runs a round every polling interval until ROUNDS rounds are done, or
+// forever without -n. With -u it is a sub-master listening on PORT for the
+// master (or sub-master) on PARENT_PORT, and p1 ... pn are its subtree.
+// -k measures round trips with kernel timestamps.
 int main(int argc, char **argv) {
-	TIMESTAMP = argc > 1 ? convert_to_timestamp(argv[1]) : 0;
+	int num_rounds = 0;
+	int skew_bound_us = DEFAULT_SKEW_BOUND_US;
+	int port = PORT;
+	int parent_port = 0;
+	int kernel_timestamps = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "n:b:l:u:k")) != -1) {
+		switch(opt) {
+			case 'n': num_rounds = atoi(optarg); break;
+			case 'b': skew_bound_us = atoi(optarg); break;
+			case 'l': port = atoi(optarg); break;
+			case 'u': parent_port = atoi(optarg); break;
+			case 'k': kernel_timestamps = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n ROUNDS] [-b SKEW_BOUND_US] [-l PORT] [-u PARENT_PORT] [-k] hh:mm:ss|now p1 ... pn\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	long long start_time = (argc > 1 && strcmp(argv[1], "now") != 0) ? convert_to_timestamp(argv[1]) : realtime_ns();
+	CLOCK_OFFSET = start_time - monotonic_ns();
 
     int num_clients = (argc > 2) ? argc - 2 : 0;
 	struct sockaddr* client_addrs[num_clients];
@@ -187,39 +675,77 @@ int main(int argc, char **argv) {
 	socklen_t addrlen = sizeof(struct sockaddr);
 	memset(&addr, 0, sizeof(struct sockaddr_in));
 	addr.sin_family = AF_INET;
-	addr.sin_port = PORT;
+	addr.sin_port = port;
 	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	printf("Attempting to start daemon on port %d\n", PORT);
+	printf("Attempting to start daemon on port %d\n", port);
 
 	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
 		handle_error("bind()");
 	}
 
-	printf("Server time is %s\n", convert_from_timestamp(TIMESTAMP));
+	if(kernel_timestamps) {
+		enable_kernel_timestamps(sock);
+	}
 
-	struct ClientMessage client_resp;
-	do {
-		int* client_timestamps = collect_client_timestamps(sock, num_clients, client_addrs);
+	printf("Server time is %s\n", convert_from_timestamp(local_time()));
+
+	if(parent_port) {
+		run_submaster(sock, parent_port, num_clients, client_addrs);
+		send_fins(sock, num_clients, client_addrs);
+		close(sock);
+		return 0;
+	}
+
+	int interval_ms = MIN_POLL_MS;
+	for(int round = 1; num_rounds == 0 || round <= num_rounds; round++) {
+		int responded[num_clients];
+		int counts[num_clients];
+		long long rtts[num_clients];
+		long long lows[num_clients];
+		long long highs[num_clients];
+		long long round_start = monotonic_ns();
+		long long* client_offsets = collect_client_offsets(sock, round, ROUND_TIMEOUT_MS, num_clients, client_addrs, responded, counts, rtts,
+				lows, highs);
+		double round_ms = (monotonic_ns() - round_start) / 1e6;
 
-		int synchronized_time = synchronize_time(client_timestamps, num_clients);
+		// Everything past the last round's residual is drift over the
+		// interval, measured across every clock in the tree.
+		double skew_us = measure_skew_us(client_offsets, lows, highs, responded, num_clients);
 
-		printf("Synchronized time is %s\n", convert_from_timestamp(synchronized_time));
+		int num_clocks;
+		long long synchronized_offset = synchronize_offset(client_offsets, responded, counts, num_clients, &num_clocks);
+		long long mean_error = synchronization_error(rtts, responded, counts, num_clients, num_clocks);
+
+		printf("Synchronized time is %s\n", convert_from_timestamp(local_time() + calculate_delta(synchronized_offset, 0)));
+
+		long long* client_deltas = calculate_client_deltas(synchronized_offset, client_offsets, num_clients);
 
-		int* client_deltas = calculate_client_deltas(synchronized_time, client_timestamps, num_clients);
-		
 		printf("Sending calculated deltas to clients...\n");
 
-		if(send_deltas(sock, num_clients, client_addrs, client_deltas)) {
+		if(send_deltas(sock, num_clients, client_addrs, client_deltas, responded, rtts, mean_error)) {
 			exit(EXIT_FAILURE);
 		}
 
-		TIMESTAMP += calculate_delta(synchronized_time, TIMESTAMP);
+		adjust_clock(calculate_delta(synchronized_offset, 0));
+
+		free(client_offsets);
+		free(client_deltas);
 
-		printf("Updated server time is %s\n", convert_from_timestamp(TIMESTAMP));
-	} while(0);
+		int previous_ms = interval_ms;
+		interval_ms = next_poll_interval(interval_ms, skew_us, skew_bound_us);
+
+		printf("Round %d: %d clocks polled in %.3f ms, skew %.3f us over %d ms (bound %d us), error %.3f us, next round in %d ms\n",
+				round, num_clocks, round_ms, skew_us, previous_ms, skew_bound_us, mean_error / 1000.0, interval_ms);
+
+		if(num_rounds == 0 || round < num_rounds) {
+			usleep(interval_ms * 1000);
+		}
+	}
+
+	send_fins(sock, num_clients, client_addrs);
 
 	close(sock);
-	
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,360 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#define PORT ((1<<13)+5)
+#define CLIENT_DATA_LEN sizeof(struct ClientMessage)
+#define PROTOCOL_VERSION 5
+#define NS_PER_SEC 1000000000LL
+#define KERNEL_TIMESTAMPS_FLAG 1
+#define CONTROL_LEN 256
+#define ROUND_TIMEOUT_MS 1000
+#define ROUND_GAP_US 2000
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum MSG_TYPE {SYN, SYNACK, ACK, FIN};
+
+enum STAMPING {USER, KERNEL};
+
+struct ClientMessage {
+	int flags;
+	int version;
+	enum MSG_TYPE msg;
+	int round;
+	long long time;
+	long long delta;
+	long long hold;
+	int count;
+	int budget_ms;
+	long long error;
+	long long low;
+	long long high;
+};
+
+volatile int load_running;
+unsigned int num_sends;
+
+long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+long long realtime_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+long long kernel_to_monotonic(struct timespec* ts) {
+	long long stamp = (long long)ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+	return stamp - (realtime_ns() - monotonic_ns());
+}
+
+long long get_kernel_timestamp(struct msghdr* msg) {
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping* stamps = (struct scm_timestamping*)CMSG_DATA(cmsg);
+			if(stamps->ts[0].tv_sec != 0 || stamps->ts[0].tv_nsec != 0) {
+				return kernel_to_monotonic(&stamps->ts[0]);
+			}
+		}
+	}
+	return 0;
+}
+
+long long get_transmit_timestamp(int sock, unsigned int* send_index) {
+	char control[CONTROL_LEN];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_control = control;
+	msg.msg_controllen = CONTROL_LEN;
+	if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+		return 0;
+	}
+	*send_index = 0;
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+			struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+			if(err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+				*send_index = err->ee_data;
+			}
+		}
+	}
+	long long stamp = get_kernel_timestamp(&msg);
+	return (stamp != 0) ? stamp : -1;
+}
+
+// Queued transmit timestamps keep POLLERR raised until they are read, so
+// they are taken off the error queue whenever it is reported.
+void drain_transmit_timestamps(int sock, unsigned int first_send, int num_clients, long long* sent_at, int* stamped) {
+	unsigned int send_index;
+	long long stamp;
+	while((stamp = get_transmit_timestamp(sock, &send_index)) != 0) {
+		unsigned int j = send_index - first_send;
+		if(stamp > 0 && j < (unsigned int)num_clients) {
+			sent_at[j] = stamp;
+			stamped[j] = 1;
+		}
+	}
+}
+
+void sendMessage(int sock, enum MSG_TYPE msg, int flags, int round, struct sockaddr_in* addr) {
+	struct ClientMessage message;
+	memset(&message, 0, CLIENT_DATA_LEN);
+	message.version = PROTOCOL_VERSION;
+	message.msg = msg;
+	message.flags = flags;
+	message.round = round;
+	if(sendto(sock, &message, CLIENT_DATA_LEN, 0, (struct sockaddr*)addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("sendto()");
+	}
+	num_sends++;
+}
+
+int find_client(int num_clients, struct sockaddr_in* client_addrs, struct sockaddr_in* addr) {
+	for(int i = 0; i < num_clients; i++) {
+		if(client_addrs[i].sin_port == addr->sin_port) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// One round of the master's measurement without the corrections: stores
+// each client's offset, or leaves answered[i] clear. USER stamps with
+// CLOCK_MONOTONIC around the syscalls on both ends, KERNEL with the
+// kernel's transmit and receive timestamps.
+void measureRound(int sock, int round, enum STAMPING stamping, int num_clients, struct sockaddr_in* client_addrs,
+		long long* offsets, int* answered) {
+	long long sent_at[num_clients];
+	int stamped[num_clients];
+	unsigned int send_index;
+	while(get_transmit_timestamp(sock, &send_index) != 0);
+	unsigned int first_send = num_sends;
+
+	for(int i = 0; i < num_clients; i++) {
+		answered[i] = 0;
+		stamped[i] = 0;
+		sent_at[i] = monotonic_ns();
+		sendMessage(sock, SYN, (stamping == KERNEL) ? KERNEL_TIMESTAMPS_FLAG : 0, round, &client_addrs[i]);
+	}
+
+	long long deadline = monotonic_ns() + ROUND_TIMEOUT_MS * 1000000LL;
+	int num_answers = 0;
+	while(num_answers < num_clients) {
+		long long now = monotonic_ns();
+		if(now >= deadline) {
+			break;
+		}
+		struct pollfd pfd = {sock, POLLIN, 0};
+		if(poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) < 0) {
+			handle_error("poll()");
+		}
+		if(pfd.revents & POLLERR) {
+			drain_transmit_timestamps(sock, first_send, num_clients, sent_at, stamped);
+		}
+		if(!(pfd.revents & POLLIN)) {
+			continue;
+		}
+
+		struct ClientMessage resp;
+		struct sockaddr_in addr;
+		char control[CONTROL_LEN];
+		struct iovec iov = {&resp, CLIENT_DATA_LEN};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CONTROL_LEN;
+		int len = recvmsg(sock, &msg, 0);
+		long long arrival = monotonic_ns();
+		if(len < 0) {
+			handle_error("recvmsg()");
+		}
+		if(len != CLIENT_DATA_LEN || resp.version != PROTOCOL_VERSION || resp.msg != SYNACK || resp.round != round) {
+			continue;
+		}
+		int i = find_client(num_clients, client_addrs, &addr);
+		if(i < 0 || answered[i]) {
+			continue;
+		}
+
+		if(stamping == KERNEL) {
+			long long stamp = get_kernel_timestamp(&msg);
+			if(stamp != 0) {
+				arrival = stamp;
+			}
+			if(!stamped[i]) {
+				drain_transmit_timestamps(sock, first_send, num_clients, sent_at, stamped);
+			}
+		}
+
+		long long rtt = arrival - sent_at[i] - resp.hold;
+		offsets[i] = resp.time + resp.hold + rtt / 2 - (arrival + realtime_ns() - monotonic_ns());
+		answered[i] = 1;
+		num_answers++;
+	}
+}
+
+void* runLoad(void* arg) {
+	(void)arg;
+	volatile unsigned long long spins = 0;
+	while(load_running) {
+		spins++;
+	}
+	return NULL;
+}
+
+int compareLongLong(const void* a, const void* b) {
+	long long x = *(long long*)a, y = *(long long*)b;
+	return (x > y) - (x < y);
+}
+
+// Jitter is the spread of each client's measured offset around that
+// client's own mean, which takes out whatever constant offset it has.
+void reportJitter(const char* name, long long* samples, int* answered, int num_rounds, int num_clients) {
+	long long* deviations = (long long*)malloc(sizeof(long long) * num_rounds * num_clients);
+	int n = 0;
+	double sum_sq = 0;
+	for(int c = 0; c < num_clients; c++) {
+		double mean = 0;
+		int count = 0;
+		for(int r = 0; r < num_rounds; r++) {
+			if(answered[r * num_clients + c]) {
+				mean += samples[r * num_clients + c];
+				count++;
+			}
+		}
+		if(count == 0) {
+			continue;
+		}
+		mean /= count;
+		for(int r = 0; r < num_rounds; r++) {
+			if(answered[r * num_clients + c]) {
+				double deviation = samples[r * num_clients + c] - mean;
+				sum_sq += deviation * deviation;
+				deviations[n++] = llabs((long long)deviation);
+			}
+		}
+	}
+	if(n == 0) {
+		printf("%-6s no answers\n", name);
+		free(deviations);
+		return;
+	}
+	qsort(deviations, n, sizeof(long long), compareLongLong);
+	printf("%-6s samples=%d jitter stddev=%.3f us p50=%.3f us p99=%.3f us max=%.3f us\n", name, n,
+			sqrt(sum_sq / n) / 1000.0, deviations[n / 2] / 1000.0, deviations[(n * 99) / 100] / 1000.0,
+			deviations[n - 1] / 1000.0);
+	free(deviations);
+}
+
+// ./stamp_bench [-r ROUNDS] [-l LOAD_THREADS] p1 p2 ... pn
+// Polls running Berkeley clients the way the master does, alternating
+// rounds stamped in user space and with kernel timestamps, and compares how
+// much the offsets measured each way jitter. The clients are never
+// corrected and get FIN at the end. LOAD_THREADS busy threads compete with
+// both ends for the CPU.
+int main(int argc, char **argv) {
+	int num_rounds = 1000;
+	int num_load = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "r:l:")) != -1) {
+		switch(opt) {
+			case 'r': num_rounds = atoi(optarg); break;
+			case 'l': num_load = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-r ROUNDS] [-l LOAD_THREADS] p1 ... pn\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	int num_clients = argc - optind;
+	if(num_clients <= 0) {
+		fprintf(stderr, "Usage: %s [-r ROUNDS] [-l LOAD_THREADS] p1 ... pn\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	struct sockaddr_in* client_addrs = (struct sockaddr_in*)calloc(num_clients, sizeof(struct sockaddr_in));
+	for(int i = 0; i < num_clients; i++) {
+		client_addrs[i].sin_family = AF_INET;
+		client_addrs[i].sin_port = atoi(argv[optind + i]);
+		client_addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	// The user-stamped rounds get a socket of their own, so transmit
+	// timestamps are neither taken nor queued for them. Clients answer a
+	// SYN on the socket it came from.
+	int socks[2];
+	for(int s = USER; s <= KERNEL; s++) {
+		if((socks[s] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+			handle_error("socket()");
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(struct sockaddr_in));
+		addr.sin_family = AF_INET;
+		addr.sin_port = (s == KERNEL) ? PORT : 0;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if(bind(socks[s], (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+			handle_error("bind()");
+		}
+	}
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+			SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	if(setsockopt(socks[KERNEL], SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		handle_error("setsockopt(SO_TIMESTAMPING)");
+	}
+
+	pthread_t load_threads[num_load > 0 ? num_load : 1];
+	load_running = 1;
+	for(int i = 0; i < num_load; i++) {
+		pthread_create(&load_threads[i], NULL, runLoad, NULL);
+	}
+
+	long long* samples[2];
+	int* answered[2];
+	for(int s = USER; s <= KERNEL; s++) {
+		samples[s] = (long long*)calloc((size_t)num_rounds * num_clients, sizeof(long long));
+		answered[s] = (int*)calloc((size_t)num_rounds * num_clients, sizeof(int));
+	}
+
+	for(int r = 0; r < num_rounds; r++) {
+		for(int s = USER; s <= KERNEL; s++) {
+			measureRound(socks[s], 2 * r + s + 1, (enum STAMPING)s, num_clients, client_addrs,
+					samples[s] + (size_t)r * num_clients, answered[s] + (size_t)r * num_clients);
+			usleep(ROUND_GAP_US);
+		}
+	}
+
+	load_running = 0;
+	for(int i = 0; i < num_load; i++) {
+		pthread_join(load_threads[i], NULL);
+	}
+
+	printf("clients=%d rounds=%d load_threads=%d\n", num_clients, num_rounds, num_load);
+	reportJitter("user", samples[USER], answered[USER], num_rounds, num_clients);
+	reportJitter("kernel", samples[KERNEL], answered[KERNEL], num_rounds, num_clients);
+
+	for(int i = 0; i < num_clients; i++) {
+		sendMessage(socks[KERNEL], FIN, 0, 0, &client_addrs[i]);
+	}
+	close(socks[USER]);
+	close(socks[KERNEL]);
+
+	return 0;
+}
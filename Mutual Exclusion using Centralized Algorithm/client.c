@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>
 
 #define NR_RESOURCES 2
 #define REQ_LEN sizeof(struct Request)
@@ -18,15 +19,18 @@
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY};
+enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, DENIED};
 enum RETRY {DIE, DONT_DIE};
 
 struct Request {
 	int flags;
 	int res;
 	enum MSG_TYPE msg;
+	int txn;
 };
 
+int txn = 0;
+
 struct Response {
 	int flags;
 	char path_to_resource[RESOURCE_LEN];
@@ -34,13 +38,17 @@ struct Response {
 };
 
 int sendRequest(int sock, struct Request* req, struct sockaddr_in* addr) {
-	return sendto(sock, req, REQ_LEN, 0, (struct sockaddr*)addr, sizeof(struct sockaddr));
+	// without a transaction keep the original layout, which Maekawa nodes tell apart from their peer messages by size
+	size_t len = (req->txn != 0) ? REQ_LEN : offsetof(struct Request, txn);
+	return sendto(sock, req, len, 0, (struct sockaddr*)addr, sizeof(struct sockaddr));
 }
 
 void sendResourceRequest(int res, int sock, struct sockaddr_in* addr) {
 	struct Request req;
+	req.flags = 0;
 	req.msg = REQ;
 	req.res = res;
+	req.txn = txn;
 	if(sendRequest(sock, &req, addr) < 0) {
 		handle_error("sendto(REQ)");
 	}
@@ -48,8 +56,10 @@ void sendResourceRequest(int res, int sock, struct sockaddr_in* addr) {
 
 void sendReleaseRequest(int res, int sock, struct sockaddr_in* addr) {
 	struct Request req;
+	req.flags = 0;
 	req.msg = RELEASE;
 	req.res = res;
+	req.txn = txn;
 	if(sendRequest(sock, &req, addr) < 0) {
 		handle_error("sendto(RELEASE)");
 	}
@@ -129,9 +139,12 @@ void disableTimeout(int sock) {
 	setTimeout(sock, 0);
 }
 
+// ./client SERVER_PORT CLIENT_OFFSET [TXN]
+// With TXN every lock is taken under that 2PC transaction and kept until its decision reaches the server.
 int main(int argc, char **argv) {
 	int server_port = (argc > 1) ? atoi(argv[1]) : (1<<13);
 	int port = (argc > 2) ? (server_port<<1)+atoi(argv[2]) : (server_port<<1);
+	txn = (argc > 3) ? atoi(argv[3]) : 0;
 	
 	int sock;
 	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -176,6 +189,11 @@ int main(int argc, char **argv) {
 			waitForServerResponse(sock, &server_resp, DONT_DIE);
 		}
 
+		if(server_resp.msg == DENIED) {
+			printf("Transaction %d ended before resource %d was granted\n", txn, res);
+			break;
+		}
+
 		assert(server_resp.msg == OK);
 		char* resource = server_resp.path_to_resource;
 
@@ -194,13 +212,17 @@ int main(int argc, char **argv) {
 		
 		printf("Exiting Critical Section.\n");
 
-		printf("Attempting to release resource %s\n", resource);
+		if(txn != 0) {
+			printf("Keeping resource %s until transaction %d commits or aborts\n", resource, txn);
+		} else {
+			printf("Attempting to release resource %s\n", resource);
 
-		sendReleaseRequest(res, sock, &server_addr);
-		waitForServerResponse(sock, &server_resp, DIE);
+			sendReleaseRequest(res, sock, &server_addr);
+			waitForServerResponse(sock, &server_resp, DIE);
 
-		assert(server_resp.msg == ACK);
-		printf("Successfully released resource %d\n", res);
+			assert(server_resp.msg == ACK);
+			printf("Successfully released resource %d\n", res);
+		}
 
 		printf("Do you wish to continue? (y/N)\n");
 		scanf("%s", choice);
@@ -0,0 +1,227 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#define REQ_LEN sizeof(struct Request)
+#define RESP_LEN sizeof(struct Response)
+#define RESOURCE_LEN 64
+#define MAX_SAMPLES (1<<18)
+#define VOTE_LEN sizeof(struct VoteMessage)
+#define GLOBAL_COMMIT 5
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, DENIED};
+
+struct Request {
+	int flags;
+	int res;
+	enum MSG_TYPE msg;
+	int txn;
+};
+
+// The 2 Phase Commit decision, of which only GLOBAL_COMMIT is sent here.
+struct VoteMessage {
+	int flags;
+	int txn;
+	int msg;
+};
+
+struct Response {
+	int flags;
+	char path_to_resource[RESOURCE_LEN];
+	enum MSG_TYPE msg;
+};
+
+struct LoadClient {
+	int sock;
+	int res;
+	int id;
+	struct sockaddr_in server_addr;
+	uint64_t* latency;
+	int num_samples;
+	int timeouts;
+	pthread_t thread;
+};
+
+volatile int load_running;
+int commit_sock = -1;
+struct sockaddr_in commit_addr;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int sendRequest(int sock, enum MSG_TYPE msg, int res, int txn, struct sockaddr_in* addr) {
+	struct Request req;
+	req.flags = 0;
+	req.msg = msg;
+	req.res = res;
+	req.txn = txn;
+	// without a transaction keep the original layout, which Maekawa nodes tell apart from their peer messages by size
+	size_t len = (txn != 0) ? REQ_LEN : offsetof(struct Request, txn);
+	return sendto(sock, &req, len, 0, (struct sockaddr*)addr, sizeof(struct sockaddr));
+}
+
+int waitForServerResponse(int sock, struct Response* resp) {
+	return recv(sock, resp, RESP_LEN, 0);
+}
+
+void setTimeout(int sock, int duration) {
+	struct timeval to;
+	to.tv_sec = duration;
+	to.tv_usec = 0;
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&to, sizeof(struct timeval)) < 0) {
+		handle_error("setsockopt()");
+	}
+}
+
+// Stands in for the 2PC coordinator's phase-two multicast, which is what
+// releases a transaction's locks. Its ACKs are never read.
+void sendCommitDecision(int txn) {
+	struct VoteMessage vote;
+	vote.flags = 0;
+	vote.txn = txn;
+	vote.msg = GLOBAL_COMMIT;
+	if(sendto(commit_sock, &vote, VOTE_LEN, 0, (struct sockaddr*)&commit_addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("sendto(GLOBAL_COMMIT)");
+	}
+}
+
+// Runs REQ -> OK -> RELEASE -> ACK back to back, timing REQ to OK. In
+// transaction mode each REQ opens a transaction whose commit decision
+// releases the lock, so RELEASE -> ACK is not needed.
+void* runLoadClient(void* arg) {
+	struct LoadClient* client = (struct LoadClient*)arg;
+	struct Response resp;
+	int seq = 0;
+	while(load_running && client->num_samples < MAX_SAMPLES) {
+		int txn = (commit_sock >= 0) ? (client->id << 20) + (++seq & ((1<<20) - 1)) + 1 : 0;
+		uint64_t start = now_ns();
+		if(sendRequest(client->sock, REQ, client->res, txn, &client->server_addr) < 0) {
+			handle_error("sendto(REQ)");
+		}
+		do {
+			if(waitForServerResponse(client->sock, &resp) < 0) {
+				client->timeouts++;
+				return NULL;
+			}
+		} while(resp.msg == BUSY);
+		if(resp.msg == DENIED) {
+			// the transaction ended while this request was queued
+			continue;
+		}
+		assert(resp.msg == OK);
+		client->latency[client->num_samples++] = now_ns() - start;
+
+		if(commit_sock >= 0) {
+			sendCommitDecision(txn);
+			continue;
+		}
+		if(sendRequest(client->sock, RELEASE, client->res, 0, &client->server_addr) < 0) {
+			handle_error("sendto(RELEASE)");
+		}
+		if(waitForServerResponse(client->sock, &resp) < 0) {
+			client->timeouts++;
+			return NULL;
+		}
+		assert(resp.msg == ACK);
+	}
+	return NULL;
+}
+
+int compareLatency(const void* a, const void* b) {
+	uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// ./loadgen SERVER_PORT NUM_SERVERS NUM_CLIENTS DURATION [RESOURCE [COMMIT_PORT]]
+// Client i talks to SERVER_PORT + (i % NUM_SERVERS), so the same run drives either the
+// centralized server (NUM_SERVERS = 1) or every node of a Maekawa deployment.
+// With COMMIT_PORT every acquisition is a transaction released by its commit decision.
+int main(int argc, char **argv) {
+	int server_port = (argc > 1) ? atoi(argv[1]) : (1<<13)+5;
+	int num_servers = (argc > 2) ? atoi(argv[2]) : 1;
+	int num_clients = (argc > 3) ? atoi(argv[3]) : 8;
+	int duration = (argc > 4) ? atoi(argv[4]) : 5;
+	int res = (argc > 5) ? atoi(argv[5]) : 1;
+	int commit_port = (argc > 6) ? atoi(argv[6]) : 0;
+
+	if(commit_port) {
+		if((commit_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+			handle_error("socket()");
+		}
+		memset(&commit_addr, 0, sizeof(struct sockaddr_in));
+		commit_addr.sin_family = AF_INET;
+		commit_addr.sin_port = commit_port;
+		commit_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	struct LoadClient* clients = (struct LoadClient*)malloc(sizeof(struct LoadClient) * num_clients);
+	load_running = 1;
+	for(int i = 0; i < num_clients; i++) {
+		struct LoadClient* client = &clients[i];
+		if((client->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+			handle_error("socket()");
+		}
+		setTimeout(client->sock, 5);
+		memset(&client->server_addr, 0, sizeof(struct sockaddr_in));
+		client->server_addr.sin_family = AF_INET;
+		client->server_addr.sin_port = server_port + (i % num_servers);
+		client->server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		client->res = res;
+		client->id = i;
+		client->latency = (uint64_t*)malloc(sizeof(uint64_t) * MAX_SAMPLES);
+		client->num_samples = 0;
+		client->timeouts = 0;
+		pthread_create(&client->thread, NULL, runLoadClient, client);
+	}
+
+	uint64_t start = now_ns();
+	sleep(duration);
+	load_running = 0;
+
+	int total = 0, timeouts = 0;
+	for(int i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		close(clients[i].sock);
+		total += clients[i].num_samples;
+		timeouts += clients[i].timeouts;
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	uint64_t* latency = (uint64_t*)malloc(sizeof(uint64_t) * (total + 1));
+	int n = 0;
+	for(int i = 0; i < num_clients; i++) {
+		memcpy(latency + n, clients[i].latency, sizeof(uint64_t) * clients[i].num_samples);
+		n += clients[i].num_samples;
+		free(clients[i].latency);
+	}
+	qsort(latency, total, sizeof(uint64_t), compareLatency);
+
+	printf("servers=%d clients=%d acquisitions=%d timeouts=%d%s\n", num_servers, num_clients, total, timeouts,
+			commit_port ? " (released by commit)" : "");
+	if(total > 0) {
+		printf("throughput=%.1f acquisitions/s acquire p50=%.1fus p99=%.1fus\n", total / elapsed,
+				latency[total / 2] / 1000.0, latency[(total * 99) / 100] / 1000.0);
+	}
+
+	free(latency);
+	free(clients);
+
+	return 0;
+}
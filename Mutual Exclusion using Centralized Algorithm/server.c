@@ -7,23 +7,36 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <assert.h>
+#include <poll.h>
 
 #define PORT ((1<<13)+5)
 #define NR_RESOURCES 2
 #define CLIENT_DATA_LEN sizeof(struct ClientResponse)
 #define REQ_LEN sizeof(struct ClientRequest)
 #define RESOURCE_LEN 64
+#define VOTE_LEN sizeof(struct VoteMessage)
+#define MAX_PARTICIPANTS 1024
+#define MAX_BATCH 128
+#define BATCH (1<<16)
+#define ENDED_HISTORY 1024
+#define COMMIT_BUFFER_LEN (sizeof(struct BatchHeader) + sizeof(int) * MAX_PARTICIPANTS + VOTE_LEN * MAX_BATCH)
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY};
+enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, DENIED};
 enum RES_STATE {RES_AVAIL, RES_BUSY, RES_DOWN};
+// Same order as the 2 Phase Commit messages; their ACK is COMMIT_ACK here.
+enum COMMIT_MSG_TYPE {START_2PC, INIT, VOTE_REQUEST, VOTE_COMMIT, VOTE_ABORT, GLOBAL_COMMIT, GLOBAL_ABORT, COMMIT_ACK, DECISION_REQUEST,
+	VOTE_READONLY, COMMIT_REQUEST, PRE_COMMIT, PRE_COMMIT_ACK};
 
+// A lock taken under a transaction (locked_txn != 0) is strict two-phase:
+// RELEASE does not free it, the 2PC decision for the transaction does.
 struct Resource {
 	int id;
 	char* path_to_resource;
 	struct sockaddr* locked_by;
+	int locked_txn;
 } RESOURCES[NR_RESOURCES];
 
 void initializeResource(int id, const char* path_to_resource) {
@@ -50,6 +63,7 @@ struct Resource* getResource(int res) {
 
 struct QueueNode {
 	struct sockaddr* addr;
+	int txn;
 	struct QueueNode* next;
 };
 
@@ -65,6 +79,7 @@ struct ClientRequest {
 	int flags;
 	int res;
 	enum MSG_TYPE msg;
+	int txn;
 };
 
 struct ClientResponse {
@@ -73,6 +88,18 @@ struct ClientResponse {
 	enum MSG_TYPE msg;
 };
 
+struct VoteMessage {
+	int flags;
+	int txn;
+	enum COMMIT_MSG_TYPE msg;
+};
+
+struct BatchHeader {
+	int flags;
+	int count;
+	int num_participants;
+};
+
 struct Queue* createQueue() {
 	struct Queue* q = malloc(sizeof(struct Queue));
 	q->size = 0;
@@ -88,9 +115,10 @@ struct QueueNode* createQueueNode() {
 	return node;
 }
 
-void push(struct Queue* q, struct sockaddr* addr) {
+void push(struct Queue* q, struct sockaddr* addr, int txn) {
 	struct QueueNode* node = createQueueNode();
 	node->addr = addr;
+	node->txn = txn;
 	q->size++;
 	if(q->front == NULL) {
 		q->front = node;
@@ -159,6 +187,12 @@ void reportResourceBusy(int sock, struct sockaddr* addr) {
 	}
 }
 
+void reportRequestDenied(int sock, struct sockaddr* addr) {
+	if(sendStatusResponse(DENIED, sock, addr) < 0) {
+		handle_error("sendto(DENIED)");
+	}
+}
+
 struct sockaddr* getResourceOwner(int res) {
 	return getResource(res)->locked_by;
 }
@@ -171,12 +205,13 @@ enum RES_STATE getResourceState(int res) {
 	return isResourceBusy(res);
 }
 
-void addClientToQueue(int res, struct sockaddr* addr) {
+void addClientToQueue(int res, struct sockaddr* addr, int txn) {
 	struct Queue* q = getResourceQueue(res);
-	push(q, addr);
+	push(q, addr, txn);
 }
 
-void lockResource(int res, struct sockaddr* addr) {
+void lockResource(int res, struct sockaddr* addr, int txn) {
+	getResource(res)->locked_txn = txn;
 	if(getResourceOwner(res) == addr) {
 		return;
 	}
@@ -185,6 +220,7 @@ void lockResource(int res, struct sockaddr* addr) {
 
 void releaseResource(int res) {
 	getResource(res)->locked_by = NULL;
+	getResource(res)->locked_txn = 0;
 }
 
 int getClientPort(struct sockaddr* addr) {
@@ -194,18 +230,19 @@ int getClientPort(struct sockaddr* addr) {
 struct sockaddr* handleResourceRelease(int res) {
 	struct Queue* q = getResourceQueue(res);
 	struct sockaddr* addr = NULL;
+	struct sockaddr* owner = getResourceOwner(res);
 	if(!empty(q)) {
 		struct sockaddr old_addr = front(q);
+		int txn = q->front->txn;
 		pop(q);
 		addr = malloc(sizeof(struct sockaddr));
 		memcpy(addr, &old_addr, sizeof(struct sockaddr));
-		lockResource(res, addr);
+		lockResource(res, addr, txn);
 	} else {
-		struct sockaddr* owner = getResourceOwner(res);
 		releaseResource(res);
 		assert(getResourceOwner(res) == NULL);
-		free(owner);
 	}
+	free(owner);
 	return addr;
 }
 
@@ -218,24 +255,52 @@ int areClientsSame(struct sockaddr* addr1, struct sockaddr* addr2) {
 	return getClientPort(addr1) == getClientPort(addr2);
 }
 
+// The last ENDED_HISTORY transactions we are done with: they voted
+// READONLY or ABORT, or their outcome arrived. No decision will come for
+// them again, so a lock taken by a late REQ under one would never be freed.
+int ENDED_TXNS[ENDED_HISTORY];
+int NUM_ENDED;
+int NEXT_ENDED;
+
+void rememberEndedTransaction(int txn) {
+	ENDED_TXNS[NEXT_ENDED] = txn;
+	NEXT_ENDED = (NEXT_ENDED + 1) % ENDED_HISTORY;
+	if(NUM_ENDED < ENDED_HISTORY) {
+		NUM_ENDED++;
+	}
+}
+
+int isTransactionEnded(int txn) {
+	for(int i = 0; i < NUM_ENDED; i++) {
+		if(ENDED_TXNS[i] == txn) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void handleClientRequest(int sock, struct ClientRequest* client_req, struct sockaddr* addr) {
 	enum MSG_TYPE msg = client_req->msg;
 	printf("%d\n", msg);
 	int res = client_req->res;
 	int flags = client_req->flags;
+	int txn = client_req->txn;
 	int client_port = ((struct sockaddr_in*)addr)->sin_port;
 	enum RES_STATE state = getResourceState(res);
 	switch(msg) {
 		case REQ:
 			printf("Client %d requested resource %s having id %d\n", ((struct sockaddr_in*)addr)->sin_port, getResource(res)->path_to_resource, res);
-			if(state == RES_BUSY) {
+			if(txn != 0 && isTransactionEnded(txn)) {
+				printf("Denying client %d resource %d, transaction %d is over\n", client_port, res, txn);
+				reportRequestDenied(sock, addr);
+			} else if(state == RES_BUSY) {
 				printf("Resource already busy. Responding with BUSY signal...\n");
-				addClientToQueue(res, addr);
+				addClientToQueue(res, addr, txn);
 				printQueueDetails(res);
 				reportResourceBusy(sock, addr);
 			} else if(state == RES_AVAIL) {
 				printf("Granting access to client %d\n", client_port);
-				lockResource(res, addr);
+				lockResource(res, addr, txn);
 				// printf("[DEBUG] %d\n", ((struct sockaddr_in*)addr)->sin_port);
 				reportRequestGranted(res, sock, addr);
 			}
@@ -252,6 +317,10 @@ void handleClientRequest(int sock, struct ClientRequest* client_req, struct sock
 				printf("[ERROR] Trying to release resource not owned by client.\n");
 				break;
 			}
+			if(getResource(res)->locked_txn != 0) {
+				printf("[ERROR] Resource %d is held by transaction %d until it commits or aborts.\n", res, getResource(res)->locked_txn);
+				break;
+			}
 			if(state == RES_BUSY) {
 				printf("Releasing resource %d requested by %d\n", res, client_port);
 				struct sockaddr* next_client = handleResourceRelease(res);
@@ -267,7 +336,154 @@ void handleClientRequest(int sock, struct ClientRequest* client_req, struct sock
 	}
 }
 
+void grantNextClient(int sock, int res) {
+	struct sockaddr* next_client = handleResourceRelease(res);
+	if(next_client != NULL) {
+		printf("Granting access to next client %d\n", ((struct sockaddr_in*)next_client)->sin_port);
+		reportRequestGranted(res, sock, next_client);
+		printQueueDetails(res);
+	}
+}
+
+// Drops every request txn still has queued, telling its clients, who were
+// told BUSY and are still waiting, that it will never be granted. Then
+// frees every lock txn holds in one go, handing each resource to its next
+// waiter.
+void releaseTransactionLocks(int sock, int txn) {
+	for(int res = 1; res <= NR_RESOURCES; res++) {
+		struct Queue* q = getResourceQueue(res);
+		struct QueueNode** link = &q->front;
+		q->back = NULL;
+		while(*link != NULL) {
+			struct QueueNode* node = *link;
+			if(node->txn == txn) {
+				printf("Denying client %d resource %d, transaction %d is over\n", getClientPort(node->addr), res, txn);
+				reportRequestDenied(sock, node->addr);
+				*link = node->next;
+				q->size--;
+				free(node->addr);
+				free(node);
+			} else {
+				q->back = node;
+				link = &node->next;
+			}
+		}
+		if(isResourceBusy(res) && getResource(res)->locked_txn == txn) {
+			printf("Releasing resource %d held by transaction %d\n", res, txn);
+			grantNextClient(sock, res);
+		}
+	}
+}
+
+int isTransactionWaiting(int txn) {
+	for(int res = 1; res <= NR_RESOURCES; res++) {
+		for(struct QueueNode* node = getResourceQueue(res)->front; node != NULL; node = node->next) {
+			if(node->txn == txn) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+int isTransactionHolding(int txn) {
+	for(int res = 1; res <= NR_RESOURCES; res++) {
+		if(isResourceBusy(res) && getResource(res)->locked_txn == txn) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void sendCommitMessage(int sock, int txn, enum COMMIT_MSG_TYPE msg, struct sockaddr* addr) {
+	struct VoteMessage vote;
+	vote.flags = 0;
+	vote.txn = txn;
+	vote.msg = msg;
+	if(sendto(sock, &vote, VOTE_LEN, 0, addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("sendto(2PC)");
+	}
+}
+
+// The lock server takes part in the transaction's 2PC as a participant, so
+// the decision it is sent anyway is also the instruction to release the
+// transaction's locks. A transaction still queued for a lock cannot commit;
+// one holding none has nothing here to decide on.
+void handleCommitMessage(int sock, int commit_sock, struct VoteMessage* vote, struct sockaddr* addr) {
+	int txn = vote->txn;
+	if(vote->msg == VOTE_REQUEST) {
+		enum COMMIT_MSG_TYPE reply = VOTE_READONLY;
+		if(isTransactionWaiting(txn)) {
+			reply = VOTE_ABORT;
+			releaseTransactionLocks(sock, txn);
+		} else if(isTransactionHolding(txn)) {
+			reply = VOTE_COMMIT;
+		}
+		if(reply != VOTE_COMMIT) {
+			rememberEndedTransaction(txn);
+		}
+		sendCommitMessage(commit_sock, txn, reply, addr);
+	} else if(vote->msg == COMMIT_REQUEST) {
+		enum COMMIT_MSG_TYPE reply = isTransactionWaiting(txn) ? VOTE_ABORT : VOTE_COMMIT;
+		releaseTransactionLocks(sock, txn);
+		rememberEndedTransaction(txn);
+		sendCommitMessage(commit_sock, txn, reply, addr);
+	} else if(vote->msg == PRE_COMMIT) {
+		sendCommitMessage(commit_sock, txn, PRE_COMMIT_ACK, addr);
+	} else if(vote->msg == GLOBAL_COMMIT || vote->msg == GLOBAL_ABORT) {
+		releaseTransactionLocks(sock, txn);
+		rememberEndedTransaction(txn);
+		if(vote->msg == GLOBAL_COMMIT) {
+			sendCommitMessage(commit_sock, txn, COMMIT_ACK, addr);
+		}
+	}
+}
+
+void receiveCommitMessages(int sock, int commit_sock) {
+	char buffer[COMMIT_BUFFER_LEN];
+	struct sockaddr addr;
+	socklen_t addrlen = sizeof(struct sockaddr);
+	int len = recvfrom(commit_sock, buffer, COMMIT_BUFFER_LEN, 0, &addr, &addrlen);
+	if(len < 0) {
+		handle_error("recvfrom(2PC)");
+	}
+	struct BatchHeader* header = (struct BatchHeader*)buffer;
+	if(!(header->flags & BATCH)) {
+		handleCommitMessage(sock, commit_sock, (struct VoteMessage*)buffer, &addr);
+		return;
+	}
+	if(header->count < 0 || header->count > MAX_BATCH || header->num_participants < 0 || header->num_participants > MAX_PARTICIPANTS
+			|| len < (int)(sizeof(struct BatchHeader) + sizeof(int) * header->num_participants + VOTE_LEN * header->count)) {
+		return;
+	}
+	struct VoteMessage* votes = (struct VoteMessage*)(buffer + sizeof(struct BatchHeader) + sizeof(int) * header->num_participants);
+	for(int i = 0; i < header->count; i++) {
+		handleCommitMessage(sock, commit_sock, &votes[i], &addr);
+	}
+}
+
+int bindSocket(int port) {
+	int sock;
+	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		handle_error("socket()");
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = port;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("bind()");
+	}
+	return sock;
+}
+
+// ./server [PORT [COMMIT_PORT]]
+// With COMMIT_PORT the server is also a 2PC participant there: list COMMIT_PORT among the coordinator's
+// participants and requests carrying that transaction's id hold their locks until its decision arrives.
 int main(int argc, char **argv) {
+	int port = (argc > 1) ? atoi(argv[1]) : PORT;
+	int commit_port = (argc > 2) ? atoi(argv[2]) : 0;
 	initializeResources();
 
 	int sock;
@@ -279,24 +495,47 @@ int main(int argc, char **argv) {
 	socklen_t addrlen = sizeof(struct sockaddr);
 	memset(&addr, 0, sizeof(struct sockaddr_in));
 	addr.sin_family = AF_INET;
-	addr.sin_port = PORT;
+	addr.sin_port = port;
 	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	printf("Attempting to start server on port %d\n", PORT);
+	printf("Attempting to start server on port %d\n", port);
 
 	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
 		handle_error("bind()");
 	}
 
-	printf("Listening on port %d...\n", PORT);
+	printf("Listening on port %d...\n", port);
+
+	struct pollfd pfds[2];
+	pfds[0].fd = sock;
+	pfds[0].events = POLLIN;
+	if(commit_port) {
+		pfds[1].fd = bindSocket(commit_port);
+		pfds[1].events = POLLIN;
+		printf("Taking part in 2PC on port %d...\n", commit_port);
+	}
 
 	struct ClientRequest client_req;
 	int requests = 0;
 	for(;;) {
+		if(poll(pfds, commit_port ? 2 : 1, -1) < 0) {
+			handle_error("poll()");
+		}
+		if(commit_port && (pfds[1].revents & POLLIN)) {
+			receiveCommitMessages(sock, pfds[1].fd);
+		}
+		if(!(pfds[0].revents & POLLIN)) {
+			continue;
+		}
 		struct sockaddr* client_addr = malloc(sizeof(struct sockaddr));
-		if(recvfrom(sock, &client_req, REQ_LEN, 0, client_addr, &addrlen) < 0) {
+		int len = recvfrom(sock, &client_req, REQ_LEN, 0, client_addr, &addrlen);
+		if(len < 0) {
 			handle_error("recvfrom()");
 		}
+		if(len < (int)REQ_LEN) {
+			// clients that predate transactions lock outside of any
+			client_req.txn = 0;
+		}
 		requests++;
 		printf("Handling client request number %d with message ", requests);
 		handleClientRequest(sock, &client_req, client_addr);
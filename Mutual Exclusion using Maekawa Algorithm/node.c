@@ -0,0 +1,471 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define MAX_NODES 256
+#define CLIENT_DATA_LEN sizeof(struct ClientResponse)
+#define REQ_LEN sizeof(struct ClientRequest)
+#define PEER_LEN sizeof(struct PeerMessage)
+#define RESOURCE_LEN 64
+#define RESOURCE_NAME "/tmp/resource_data_primary"
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, INQUIRE, YIELD, FAILED};
+
+struct ClientRequest {
+	int flags;
+	int res;
+	enum MSG_TYPE msg;
+};
+
+struct ClientResponse {
+	int flags;
+	char path_to_resource[RESOURCE_LEN];
+	enum MSG_TYPE msg;
+};
+
+struct PeerMessage {
+	int flags;
+	int timestamp;
+	int node;
+	enum MSG_TYPE msg;
+};
+
+// Requests are ordered by Lamport timestamp, ties broken by node id.
+struct Vote {
+	int timestamp;
+	int node;
+	int failed_sent;
+};
+
+struct QueueNode {
+	struct sockaddr* addr;
+	struct QueueNode* next;
+};
+
+struct Queue {
+	int size;
+	struct QueueNode* front;
+	struct QueueNode* back;
+};
+
+struct MaekawaNode {
+	int id;
+	int num_nodes;
+	int initial_port;
+	int clock;
+	int quorum[MAX_NODES];
+	int quorum_size;
+
+	int voted;
+	int inquired;
+	struct Vote vote;
+	struct Vote waiting[MAX_NODES];
+	int num_waiting;
+
+	int requesting;
+	int in_cs;
+	int failed;
+	struct Vote request;
+	int granted[MAX_NODES];
+	int num_granted;
+	int pending_inquire[MAX_NODES];
+
+	struct sockaddr* client;
+	struct Queue clients;
+};
+
+struct QueueNode* createQueueNode() {
+	struct QueueNode* node = (struct QueueNode*)malloc(sizeof(struct QueueNode));
+	node->addr = NULL;
+	node->next = NULL;
+	return node;
+}
+
+void push(struct Queue* q, struct sockaddr* addr) {
+	struct QueueNode* node = createQueueNode();
+	node->addr = addr;
+	q->size++;
+	if(q->front == NULL) {
+		q->front = node;
+		q->back = node;
+	} else {
+		q->back->next = node;
+		q->back = node;
+	}
+}
+
+struct sockaddr* pop(struct Queue* q) {
+	q->size--;
+	struct QueueNode* temp = q->front;
+	struct sockaddr* addr = temp->addr;
+	q->front = q->front->next;
+	if(q->front == NULL) {
+		q->back = NULL;
+	}
+	free(temp);
+	return addr;
+}
+
+int empty(struct Queue* q) {
+	return q->size == 0;
+}
+
+int getClientPort(struct sockaddr* addr) {
+	return ((struct sockaddr_in*)addr)->sin_port;
+}
+
+int max(int x, int y) {
+	return x >= y ? x : y;
+}
+
+int hasPriority(struct Vote* a, struct Vote* b) {
+	return a->timestamp < b->timestamp || (a->timestamp == b->timestamp && a->node < b->node);
+}
+
+void initializePeerAddress(struct MaekawaNode* node, struct sockaddr_in* addr, int peer) {
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_port = node->initial_port + peer;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// Nodes sit on a ceil(sqrt(N)) wide grid; a quorum is the node's row plus its
+// column, so any two quorums share at least one arbiter.
+void initializeQuorum(struct MaekawaNode* node) {
+	int width = 1;
+	while(width * width < node->num_nodes) {
+		width++;
+	}
+	node->quorum_size = 0;
+	for(int j = 0; j < node->num_nodes; j++) {
+		if(j / width == node->id / width || j % width == node->id % width) {
+			node->quorum[node->quorum_size++] = j;
+		}
+	}
+}
+
+int sendPeerMessage(int sock, struct MaekawaNode* node, enum MSG_TYPE msg, int timestamp, int peer) {
+	struct PeerMessage message;
+	struct sockaddr_in addr;
+	initializePeerAddress(node, &addr, peer);
+	message.flags = 0;
+	message.timestamp = timestamp;
+	message.node = node->id;
+	message.msg = msg;
+	return sendto(sock, &message, PEER_LEN, 0, (struct sockaddr*)&addr, sizeof(struct sockaddr));
+}
+
+void sendToPeer(int sock, struct MaekawaNode* node, enum MSG_TYPE msg, int timestamp, int peer) {
+	if(sendPeerMessage(sock, node, msg, timestamp, peer) < 0) {
+		handle_error("sendto(peer)");
+	}
+}
+
+void multicastToQuorum(int sock, struct MaekawaNode* node, enum MSG_TYPE msg, int timestamp) {
+	for(int i = 0; i < node->quorum_size; i++) {
+		sendToPeer(sock, node, msg, timestamp, node->quorum[i]);
+	}
+}
+
+int sendResponse(int sock, struct ClientResponse* resp, struct sockaddr* addr) {
+	return sendto(sock, resp, CLIENT_DATA_LEN, 0, addr, sizeof(struct sockaddr));
+}
+
+int sendStatusResponse(enum MSG_TYPE msg, int sock, struct sockaddr* addr) {
+	struct ClientResponse resp;
+	resp.msg = msg;
+	return sendResponse(sock, &resp, addr);
+}
+
+void reportRequestGranted(int sock, struct sockaddr* addr) {
+	struct ClientResponse resp;
+	strcpy(resp.path_to_resource, RESOURCE_NAME);
+	resp.msg = OK;
+	if(sendResponse(sock, &resp, addr) < 0) {
+		handle_error("sendto(OK)");
+	}
+}
+
+void reportAck(int sock, struct sockaddr* addr) {
+	if(sendStatusResponse(ACK, sock, addr) < 0) {
+		handle_error("sendto(ACK)");
+	}
+}
+
+void reportResourceBusy(int sock, struct sockaddr* addr) {
+	if(sendStatusResponse(BUSY, sock, addr) < 0) {
+		handle_error("sendto(BUSY)");
+	}
+}
+
+void addToWaiting(struct MaekawaNode* node, struct Vote* vote) {
+	node->waiting[node->num_waiting] = *vote;
+	node->waiting[node->num_waiting].failed_sent = 0;
+	node->num_waiting++;
+}
+
+int getBestWaiting(struct MaekawaNode* node) {
+	int best = 0;
+	for(int i = 1; i < node->num_waiting; i++) {
+		if(hasPriority(&node->waiting[i], &node->waiting[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+struct Vote removeBestWaiting(struct MaekawaNode* node) {
+	int best = getBestWaiting(node);
+	struct Vote vote = node->waiting[best];
+	node->waiting[best] = node->waiting[--node->num_waiting];
+	return vote;
+}
+
+void grantVote(int sock, struct MaekawaNode* node, struct Vote* vote) {
+	node->voted = 1;
+	node->inquired = 0;
+	node->vote = *vote;
+	sendToPeer(sock, node, OK, vote->timestamp, vote->node);
+}
+
+void grantNextWaiting(int sock, struct MaekawaNode* node) {
+	node->voted = 0;
+	node->inquired = 0;
+	if(node->num_waiting > 0) {
+		struct Vote vote = removeBestWaiting(node);
+		grantVote(sock, node, &vote);
+	}
+}
+
+// Arbiter side. Only the best waiting request may displace the current
+// holder, through a single INQUIRE; every other waiter is told it FAILED.
+void handlePeerRequest(int sock, struct MaekawaNode* node, struct Vote* vote) {
+	if(!node->voted) {
+		grantVote(sock, node, vote);
+		return;
+	}
+	addToWaiting(node, vote);
+	int best = getBestWaiting(node);
+	for(int i = 0; i < node->num_waiting; i++) {
+		struct Vote* waiter = &node->waiting[i];
+		if((i != best || hasPriority(&node->vote, waiter)) && !waiter->failed_sent) {
+			waiter->failed_sent = 1;
+			sendToPeer(sock, node, FAILED, waiter->timestamp, waiter->node);
+		}
+	}
+	if(hasPriority(&node->waiting[best], &node->vote) && !node->inquired) {
+		node->inquired = 1;
+		sendToPeer(sock, node, INQUIRE, node->vote.timestamp, node->vote.node);
+	}
+}
+
+int isCurrentVote(struct MaekawaNode* node, int peer, int timestamp) {
+	return node->voted && node->vote.node == peer && node->vote.timestamp == timestamp;
+}
+
+void handlePeerYield(int sock, struct MaekawaNode* node, int peer, int timestamp) {
+	if(!isCurrentVote(node, peer, timestamp)) {
+		return;
+	}
+	addToWaiting(node, &node->vote);
+	grantNextWaiting(sock, node);
+}
+
+void handlePeerRelease(int sock, struct MaekawaNode* node, int peer, int timestamp) {
+	if(!isCurrentVote(node, peer, timestamp)) {
+		return;
+	}
+	grantNextWaiting(sock, node);
+}
+
+void yieldVote(int sock, struct MaekawaNode* node, int peer) {
+	node->pending_inquire[peer] = 0;
+	if(!node->granted[peer]) {
+		return;
+	}
+	node->granted[peer] = 0;
+	node->num_granted--;
+	sendToPeer(sock, node, YIELD, node->request.timestamp, peer);
+}
+
+void requestCriticalSection(int sock, struct MaekawaNode* node) {
+	node->clock++;
+	node->request.timestamp = node->clock;
+	node->request.node = node->id;
+	node->requesting = 1;
+	node->failed = 0;
+	node->num_granted = 0;
+	memset(node->granted, 0, sizeof(node->granted));
+	memset(node->pending_inquire, 0, sizeof(node->pending_inquire));
+	multicastToQuorum(sock, node, REQ, node->request.timestamp);
+}
+
+void releaseCriticalSection(int sock, struct MaekawaNode* node) {
+	node->requesting = 0;
+	node->in_cs = 0;
+	multicastToQuorum(sock, node, RELEASE, node->request.timestamp);
+}
+
+void handlePeerGrant(int sock, struct MaekawaNode* node, int peer, int timestamp) {
+	if(!node->requesting || timestamp != node->request.timestamp || node->granted[peer]) {
+		return;
+	}
+	node->granted[peer] = 1;
+	node->num_granted++;
+	if(node->num_granted == node->quorum_size) {
+		node->in_cs = 1;
+		printf("Granting access to client %d\n", getClientPort(node->client));
+		reportRequestGranted(sock, node->client);
+	}
+}
+
+void handlePeerFailed(int sock, struct MaekawaNode* node, int timestamp) {
+	if(!node->requesting || timestamp != node->request.timestamp) {
+		return;
+	}
+	node->failed = 1;
+	for(int i = 0; i < node->quorum_size; i++) {
+		if(node->pending_inquire[node->quorum[i]]) {
+			yieldVote(sock, node, node->quorum[i]);
+		}
+	}
+}
+
+void handlePeerInquire(int sock, struct MaekawaNode* node, int peer, int timestamp) {
+	if(!node->requesting || node->in_cs || timestamp != node->request.timestamp) {
+		return;
+	}
+	if(node->failed) {
+		yieldVote(sock, node, peer);
+	} else {
+		node->pending_inquire[peer] = 1;
+	}
+}
+
+void handlePeerMessage(int sock, struct MaekawaNode* node, struct PeerMessage* message) {
+	node->clock = max(node->clock, message->timestamp) + 1;
+	struct Vote vote;
+	vote.timestamp = message->timestamp;
+	vote.node = message->node;
+	vote.failed_sent = 0;
+	switch(message->msg) {
+		case REQ:
+			handlePeerRequest(sock, node, &vote);
+			break;
+		case OK:
+			handlePeerGrant(sock, node, message->node, message->timestamp);
+			break;
+		case RELEASE:
+			handlePeerRelease(sock, node, message->node, message->timestamp);
+			break;
+		case INQUIRE:
+			handlePeerInquire(sock, node, message->node, message->timestamp);
+			break;
+		case YIELD:
+			handlePeerYield(sock, node, message->node, message->timestamp);
+			break;
+		case FAILED:
+			handlePeerFailed(sock, node, message->timestamp);
+			break;
+		default:
+			break;
+	}
+}
+
+void serveNextClient(int sock, struct MaekawaNode* node) {
+	if(node->client != NULL || empty(&node->clients)) {
+		return;
+	}
+	node->client = pop(&node->clients);
+	printf("Client %d requested critical section\n", getClientPort(node->client));
+	requestCriticalSection(sock, node);
+}
+
+void handleClientRequest(int sock, struct MaekawaNode* node, struct ClientRequest* client_req, struct sockaddr* addr) {
+	switch(client_req->msg) {
+		case REQ:
+			push(&node->clients, addr);
+			if(node->client != NULL) {
+				reportResourceBusy(sock, addr);
+			}
+			serveNextClient(sock, node);
+			break;
+		case RELEASE:
+			reportAck(sock, addr);
+			if(node->client == NULL || !node->in_cs || getClientPort(node->client) != getClientPort(addr)) {
+				printf("[ERROR] Trying to release critical section not owned by client.\n");
+				free(addr);
+				break;
+			}
+			printf("Client %d released critical section\n", getClientPort(addr));
+			releaseCriticalSection(sock, node);
+			free(node->client);
+			free(addr);
+			node->client = NULL;
+			serveNextClient(sock, node);
+			break;
+		default:
+			free(addr);
+			break;
+	}
+}
+
+// ./node INITIAL_PORT NODE_ID NUM_NODES
+// Clients talk to any node with the same REQ/OK/RELEASE/ACK protocol as the centralized server.
+int main(int argc, char **argv) {
+	struct MaekawaNode node;
+	memset(&node, 0, sizeof(struct MaekawaNode));
+	node.initial_port = (argc > 1) ? atoi(argv[1]) : (1<<13);
+	node.id = (argc > 2) ? atoi(argv[2]) : 0;
+	node.num_nodes = (argc > 3) ? atoi(argv[3]) : 1;
+	assert(node.num_nodes <= MAX_NODES && node.id < node.num_nodes);
+	initializeQuorum(&node);
+
+	int sock;
+	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		handle_error("socket()");
+	}
+
+	struct sockaddr_in addr;
+	initializePeerAddress(&node, &addr, node.id);
+
+	printf("Attempting to start node on port %d\n", addr.sin_port);
+
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("bind()");
+	}
+
+	printf("Listening on port %d with a quorum of %d nodes...\n", addr.sin_port, node.quorum_size);
+
+	union {
+		struct PeerMessage peer;
+		struct ClientRequest client;
+	} buffer;
+	for(;;) {
+		struct sockaddr* sender = malloc(sizeof(struct sockaddr));
+		socklen_t addrlen = sizeof(struct sockaddr);
+		int len = recvfrom(sock, &buffer, sizeof(buffer), 0, sender, &addrlen);
+		if(len < 0) {
+			handle_error("recvfrom()");
+		}
+		if(len == PEER_LEN) {
+			handlePeerMessage(sock, &node, &buffer.peer);
+			free(sender);
+		} else {
+			handleClientRequest(sock, &node, &buffer.client, sender);
+		}
+	}
+
+	return 0;
+}
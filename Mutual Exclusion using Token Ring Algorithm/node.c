@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/select.h>
 
 #define NR_RESOURCES 2
 #define REQ_LEN sizeof(struct Request)
@@ -19,8 +20,11 @@
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, GRANT};
+enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, GRANT, SUPER_GRANT};
 enum RETRY {DIE, DONT_DIE};
+enum MODE {RING, TREE, HIER};
+
+int messages_sent = 0;
 
 struct Request {
 	int flags;
@@ -34,11 +38,87 @@ struct Response {
 	enum MSG_TYPE msg;
 };
 
+struct QueueNode {
+	int port;
+	struct QueueNode* next;
+};
+
+struct Queue {
+	int size;
+	struct QueueNode* front;
+	struct QueueNode* back;
+};
+
+struct TreeNode {
+	int port;
+	int holder;
+	int using;
+	int asked;
+	struct Queue request_q;
+	struct Response token;
+};
+
+struct HierNode {
+	int port;
+	int successor;
+	int leader;
+	int super_successor;
+	int wants;
+	int demand;
+	struct Response token;
+};
+
+void initializeQueue(struct Queue* q) {
+	q->size = 0;
+	q->front = NULL;
+	q->back = NULL;
+}
+
+struct QueueNode* createQueueNode() {
+	struct QueueNode* node = (struct QueueNode*)malloc(sizeof(struct QueueNode));
+	node->port = 0;
+	node->next = NULL;
+	return node;
+}
+
+void push(struct Queue* q, int port) {
+	struct QueueNode* node = createQueueNode();
+	node->port = port;
+	q->size++;
+	if(q->front == NULL) {
+		q->front = node;
+		q->back = node;
+	} else {
+		q->back->next = node;
+		q->back = node;
+	}
+}
+
+void pop(struct Queue* q) {
+	q->size--;
+	struct QueueNode* temp = q->front;
+	q->front = q->front->next;
+	if(q->front == NULL) {
+		q->back = NULL;
+	}
+	free(temp);
+}
+
+int empty(struct Queue* q) {
+	return q->size == 0;
+}
+
+int front(struct Queue* q) {
+	return q->front->port;
+}
+
 int sendRequest(int sock, struct Request* req, struct sockaddr_in* addr) {
+	messages_sent++;
 	return sendto(sock, req, REQ_LEN, 0, (struct sockaddr*)addr, sizeof(struct sockaddr));
 }
 
 int sendResponse(int sock, struct Response* resp, struct sockaddr_in* addr) {
+	messages_sent++;
 	return sendto(sock, resp, RESP_LEN, 0, (struct sockaddr*)addr, sizeof(struct sockaddr));
 }
 
@@ -149,11 +229,288 @@ void intializeNewResource(char *resource) {
 	initializeResource(resource, RESOURCE_NAME);
 }
 
+void initializeNodeAddress(struct sockaddr_in* addr, int port) {
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_port = port;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+void performCriticalSection(char* resource) {
+	char choice[8];
+	char temp;
+
+	printf("Got exclusive access to file %s\n", resource);
+
+	printf("Entering Critical Section\n");
+
+	openAndReadResource(resource);
+
+	printf("Do you wish to edit %s? (y/N)\n", resource);
+	scanf("%s", choice);
+	scanf("%c", &temp);
+	if(strcmp(choice, "y") == 0 || strcmp(choice, "Y") == 0) {
+		openAndUpdateResource(resource);
+	}
+
+	printf("Exiting Critical Section.\n");
+}
+
+void sendTokenToNode(int sock, struct Response* resp, int port) {
+	struct sockaddr_in addr;
+	initializeNodeAddress(&addr, port);
+	printf("Sending TOKEN to %d...\n", port);
+	sendGrantResponse(sock, resp, &addr);
+}
+
+void sendSuperTokenToNode(int sock, struct Response* resp, int port) {
+	struct sockaddr_in addr;
+	initializeNodeAddress(&addr, port);
+	resp->msg = SUPER_GRANT;
+	sendGrantResponse(sock, resp, &addr);
+}
+
+void sendLocalTokenToNode(int sock, struct Response* resp, int port) {
+	resp->msg = GRANT;
+	sendTokenToNode(sock, resp, port);
+}
+
+void sendRequestToNode(int sock, int port) {
+	struct sockaddr_in addr;
+	initializeNodeAddress(&addr, port);
+	printf("Requesting TOKEN from %d...\n", port);
+	sendResourceRequest(0, sock, &addr);
+}
+
+// Raymond's algorithm: the token only travels along tree edges, towards
+// whichever neighbour sits at the head of the local request queue.
+void assignPrivilege(int sock, struct TreeNode* node) {
+	if(node->holder != node->port || node->using || empty(&node->request_q)) {
+		return;
+	}
+	node->holder = front(&node->request_q);
+	pop(&node->request_q);
+	node->asked = 0;
+	if(node->holder == node->port) {
+		node->using = 1;
+		performCriticalSection(node->token.path_to_resource);
+		printf("Messages sent so far: %d\n", messages_sent);
+		node->using = 0;
+		return assignPrivilege(sock, node);
+	}
+	sendTokenToNode(sock, &node->token, node->holder);
+}
+
+void makeRequest(int sock, struct TreeNode* node) {
+	if(node->holder != node->port && !empty(&node->request_q) && !node->asked) {
+		sendRequestToNode(sock, node->holder);
+		node->asked = 1;
+	}
+}
+
+void handleTreeEvent(int sock, struct TreeNode* node) {
+	assignPrivilege(sock, node);
+	makeRequest(sock, node);
+}
+
+int getNodeMessage(int sock, struct Response* resp, struct sockaddr_in* addr) {
+	socklen_t addrlen = sizeof(struct sockaddr);
+	int len = recvfrom(sock, resp, RESP_LEN, 0, (struct sockaddr*)addr, &addrlen);
+	if(len < 0) {
+		handle_error("recvfrom()");
+	}
+	return len;
+}
+
+void handleTreeMessage(int sock, struct TreeNode* node) {
+	struct Response resp;
+	struct sockaddr_in addr;
+	if(getNodeMessage(sock, &resp, &addr) == REQ_LEN) {
+		struct Request req;
+		memcpy(&req, &resp, REQ_LEN);
+		assert(req.msg == REQ);
+		printf("Node %d requested TOKEN\n", addr.sin_port);
+		push(&node->request_q, addr.sin_port);
+	} else {
+		assert(resp.msg == GRANT);
+		printf("Received TOKEN from %d\n", addr.sin_port);
+		memcpy(&node->token, &resp, RESP_LEN);
+		node->holder = node->port;
+	}
+	handleTreeEvent(sock, node);
+}
+
+int getUserChoice(int* stdin_open) {
+	char choice[8];
+	char temp;
+	if(scanf("%s", choice) == EOF) {
+		*stdin_open = 0;
+		return 0;
+	}
+	scanf("%c", &temp);
+	return strcmp(choice, "y") == 0 || strcmp(choice, "Y") == 0;
+}
+
+void waitForNodeEvent(int sock, int stdin_open, fd_set* fds) {
+	FD_ZERO(fds);
+	FD_SET(sock, fds);
+	if(stdin_open) {
+		FD_SET(STDIN_FILENO, fds);
+	}
+	if(select(sock + 1, fds, NULL, NULL, NULL) < 0) {
+		handle_error("select()");
+	}
+}
+
+void handleUserInput(int sock, struct TreeNode* node, int* stdin_open) {
+	if(getUserChoice(stdin_open)) {
+		printf("Attempting to get exclusive access...\n");
+		push(&node->request_q, node->port);
+		handleTreeEvent(sock, node);
+	}
+	printf("Do you wish to enter Critical Section? (y/N)\n");
+}
+
+void runTreeNode(int sock, int port, int holder_port, int initiator) {
+	struct TreeNode node;
+	node.port = port;
+	node.holder = initiator ? port : holder_port;
+	node.using = 0;
+	node.asked = 0;
+	initializeQueue(&node.request_q);
+	if(initiator) {
+		char resource[RESOURCE_LEN];
+		intializeNewResource(resource);
+		printf("Generating token %ld for resource %s...\n", generateToken(), resource);
+		initializeNodeResponse(&node.token, generateToken(), resource);
+	}
+
+	int stdin_open = 1;
+	printf("Do you wish to enter Critical Section? (y/N)\n");
+	for(;;) {
+		fd_set fds;
+		waitForNodeEvent(sock, stdin_open, &fds);
+		if(FD_ISSET(sock, &fds)) {
+			handleTreeMessage(sock, &node);
+		}
+		if(stdin_open && FD_ISSET(STDIN_FILENO, &fds)) {
+			handleUserInput(sock, &node, &stdin_open);
+		}
+	}
+}
+
+int isRingLeader(struct HierNode* node) {
+	return node->port == node->leader;
+}
+
+void serveLocalDemand(struct HierNode* node) {
+	if(node->wants) {
+		node->wants = 0;
+		performCriticalSection(node->token.path_to_resource);
+		printf("Messages sent so far: %d\n", messages_sent);
+	}
+}
+
+// A ring leader only hands the global token down into its local ring when one
+// of its members has asked for it; otherwise the token stays on the super-ring.
+void dispatchSuperToken(int sock, struct HierNode* node) {
+	if(node->demand == 0) {
+		sendSuperTokenToNode(sock, &node->token, node->super_successor);
+		return;
+	}
+	printf("Local ring has %d pending request(s)\n", node->demand);
+	node->demand = 0;
+	serveLocalDemand(node);
+	sendLocalTokenToNode(sock, &node->token, node->successor);
+}
+
+void handleHierMessage(int sock, struct HierNode* node) {
+	struct Response resp;
+	struct sockaddr_in addr;
+	if(getNodeMessage(sock, &resp, &addr) == REQ_LEN) {
+		assert(isRingLeader(node));
+		printf("Node %d requested TOKEN\n", addr.sin_port);
+		node->demand++;
+		return;
+	}
+	memcpy(&node->token, &resp, RESP_LEN);
+	if(resp.msg == SUPER_GRANT) {
+		assert(isRingLeader(node));
+		dispatchSuperToken(sock, node);
+		return;
+	}
+	assert(resp.msg == GRANT);
+	if(isRingLeader(node)) {
+		printf("TOKEN completed local ring\n");
+		sendSuperTokenToNode(sock, &node->token, node->super_successor);
+		return;
+	}
+	serveLocalDemand(node);
+	sendLocalTokenToNode(sock, &node->token, node->successor);
+}
+
+void handleHierUserInput(int sock, struct HierNode* node, int* stdin_open) {
+	if(getUserChoice(stdin_open) && !node->wants) {
+		printf("Attempting to get exclusive access...\n");
+		node->wants = 1;
+		if(isRingLeader(node)) {
+			node->demand++;
+		} else {
+			sendRequestToNode(sock, node->leader);
+		}
+	}
+	printf("Do you wish to enter Critical Section? (y/N)\n");
+}
+
+void runHierNode(int sock, int port, int successor_port, int leader_port, int super_successor_port, int initiator) {
+	struct HierNode node;
+	node.port = port;
+	node.successor = successor_port;
+	node.leader = leader_port;
+	node.super_successor = super_successor_port;
+	node.wants = 0;
+	node.demand = 0;
+
+	int stdin_open = 1;
+	printf("Do you wish to enter Critical Section? (y/N)\n");
+	if(initiator) {
+		assert(isRingLeader(&node));
+		char resource[RESOURCE_LEN];
+		intializeNewResource(resource);
+		printf("Generating token %ld for resource %s...\n", generateToken(), resource);
+		initializeNodeResponse(&node.token, generateToken(), resource);
+		dispatchSuperToken(sock, &node);
+	}
+
+	for(;;) {
+		fd_set fds;
+		waitForNodeEvent(sock, stdin_open, &fds);
+		if(FD_ISSET(sock, &fds)) {
+			handleHierMessage(sock, &node);
+		}
+		if(stdin_open && FD_ISSET(STDIN_FILENO, &fds)) {
+			handleHierUserInput(sock, &node, &stdin_open);
+		}
+	}
+}
+
+// ./node INITIAL_PORT OFFSET SUCCESSOR_OFFSET INITIATOR [ring|tree|hier] [LEADER_OFFSET] [SUPER_SUCCESSOR_OFFSET]
+// In tree mode SUCCESSOR_OFFSET is the holder, i.e. the neighbour on the path to the initiator.
+// In hier mode SUCCESSOR_OFFSET is the next node of the local ring, LEADER_OFFSET its leader,
+// and SUPER_SUCCESSOR_OFFSET (leaders only) the next leader on the super-ring.
 int main(int argc, char **argv) {
 	int initial_port = (argc > 1) ? atoi(argv[1]) : (1<<13);
 	int port = (argc > 2) ? (initial_port)+atoi(argv[2]) : (initial_port);
 	int successor_port = (argc > 3) ? (initial_port)+atoi(argv[3]) : (initial_port)+1;
 	int initiator = (argc > 4) ? (strcmp(argv[4], "y") == 0 || strcmp(argv[4], "Y") == 0 ) : 0;
+	enum MODE mode = RING;
+	if(argc > 5 && strcmp(argv[5], "tree") == 0) {
+		mode = TREE;
+	} else if(argc > 5 && strcmp(argv[5], "hier") == 0) {
+		mode = HIER;
+	}
+	int leader_port = (argc > 6) ? (initial_port)+atoi(argv[6]) : port;
+	int super_successor_port = (argc > 7) ? (initial_port)+atoi(argv[7]) : leader_port;
 
 	uint64_t TOKEN;
 	char resource[RESOURCE_LEN];
@@ -180,6 +537,12 @@ int main(int argc, char **argv) {
 
 	printf("Started client on port %d\n", port);
 
+	if(mode == TREE) {
+		runTreeNode(sock, port, successor_port, initiator);
+	} else if(mode == HIER) {
+		runHierNode(sock, port, successor_port, leader_port, super_successor_port, initiator);
+	}
+
 	struct sockaddr_in successor_addr;
 	memset(&successor_addr, 0, sizeof(struct sockaddr_in));
 	successor_addr.sin_family = AF_INET;
@@ -203,25 +566,14 @@ int main(int argc, char **argv) {
 			initializeResource(resource, node_resp.path_to_resource);
 		}
 
-		printf("Got exclusive access to file %s\n", resource);
-
-		printf("Entering Critical Section\n");
-
-		openAndReadResource(resource);
-
-		printf("Do you wish to edit %s? (y/N)\n", resource);
-		scanf("%s", choice);
-		scanf("%c", &temp);
-		if(strcmp(choice, "y") == 0 || strcmp(choice, "Y") == 0) {
-			openAndUpdateResource(resource);
-		}
-		
-		printf("Exiting Critical Section.\n");
+		performCriticalSection(resource);
 
 		printf("Sending TOKEN to %d...\n", successor_port);
 
 		sendGrantResponse(sock, &node_resp, &successor_addr);
 
+		printf("Messages sent so far: %d\n", messages_sent);
+
 		printf("Do you wish to continue? (y/N)\n");
 		scanf("%s", choice);
 		scanf("%c", &temp);
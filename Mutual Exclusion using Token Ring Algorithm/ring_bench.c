@@ -0,0 +1,247 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define REQ_LEN sizeof(struct Request)
+#define RESP_LEN sizeof(struct Response)
+#define RESOURCE_LEN 64
+#define RESOURCE_NAME "/tmp/resource_alpha"
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum MSG_TYPE {REQ, OK, RELEASE, ACK, BUSY, GRANT, SUPER_GRANT};
+
+struct Request {
+	int flags;
+	int res;
+	enum MSG_TYPE msg;
+};
+
+struct Response {
+	uint64_t TOKEN;
+	char path_to_resource[RESOURCE_LEN];
+	enum MSG_TYPE msg;
+};
+
+struct BenchNode {
+	int sock;
+	int port;
+	int successor;
+	int leader;
+	int super_successor;
+	int demand;
+	volatile int wants;
+	pthread_t thread;
+};
+
+pthread_mutex_t served_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t served_cond = PTHREAD_COND_INITIALIZER;
+volatile int bench_running;
+int rotate_on_demand;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void initializeNodeAddress(struct sockaddr_in* addr, int port) {
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_port = port;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+int createNodeSocket(int port) {
+	int sock;
+	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		handle_error("socket()");
+	}
+	struct sockaddr_in addr;
+	initializeNodeAddress(&addr, port);
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("bind()");
+	}
+	return sock;
+}
+
+void sendToken(int sock, struct Response* resp, enum MSG_TYPE msg, int port) {
+	struct sockaddr_in addr;
+	initializeNodeAddress(&addr, port);
+	resp->msg = msg;
+	if(sendto(sock, resp, RESP_LEN, 0, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("sendto(GRANT)");
+	}
+}
+
+void sendDemand(int sock, int port) {
+	struct sockaddr_in addr;
+	struct Request req;
+	initializeNodeAddress(&addr, port);
+	req.msg = REQ;
+	req.res = 0;
+	if(sendto(sock, &req, REQ_LEN, 0, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
+		handle_error("sendto(REQ)");
+	}
+}
+
+void serveNode(struct BenchNode* node) {
+	if(node->wants) {
+		pthread_mutex_lock(&served_lock);
+		node->wants = 0;
+		pthread_cond_signal(&served_cond);
+		pthread_mutex_unlock(&served_lock);
+	}
+}
+
+int isRingLeader(struct BenchNode* node) {
+	return node->port == node->leader;
+}
+
+// Same forwarding rules as node.c. A flat ring is modelled as a single local
+// ring whose leader always passes the token on, as the plain ring mode does.
+void* runBenchNode(void* arg) {
+	struct BenchNode* node = (struct BenchNode*)arg;
+	struct Response resp;
+	while(bench_running) {
+		int len = recv(node->sock, &resp, RESP_LEN, 0);
+		if(len < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				continue;
+			}
+			handle_error("recv()");
+		}
+		if(len == REQ_LEN) {
+			node->demand++;
+			continue;
+		}
+		if(resp.msg == SUPER_GRANT) {
+			if(rotate_on_demand && node->demand == 0) {
+				sendToken(node->sock, &resp, SUPER_GRANT, node->super_successor);
+				continue;
+			}
+			node->demand = 0;
+			serveNode(node);
+			sendToken(node->sock, &resp, GRANT, node->successor);
+		} else if(isRingLeader(node)) {
+			sendToken(node->sock, &resp, SUPER_GRANT, node->super_successor);
+		} else {
+			serveNode(node);
+			sendToken(node->sock, &resp, GRANT, node->successor);
+		}
+	}
+	return NULL;
+}
+
+void setTimeout(int sock, int usec) {
+	struct timeval to;
+	to.tv_sec = 0;
+	to.tv_usec = usec;
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&to, sizeof(struct timeval)) < 0) {
+		handle_error("setsockopt()");
+	}
+}
+
+// Lays out num_nodes nodes as num_rings local rings of roughly equal size.
+struct BenchNode* createTopology(int initial_port, int num_nodes, int num_rings) {
+	struct BenchNode* nodes = (struct BenchNode*)malloc(sizeof(struct BenchNode) * num_nodes);
+	int ring_size = (num_nodes + num_rings - 1) / num_rings;
+	for(int i = 0; i < num_nodes; i++) {
+		int ring = i / ring_size;
+		int first = ring * ring_size;
+		int last = (first + ring_size < num_nodes) ? first + ring_size - 1 : num_nodes - 1;
+		int next_ring_first = (last + 1 < num_nodes) ? last + 1 : 0;
+		nodes[i].port = initial_port + i;
+		nodes[i].leader = initial_port + first;
+		nodes[i].successor = initial_port + ((i == last) ? first : i + 1);
+		nodes[i].super_successor = initial_port + next_ring_first;
+		nodes[i].demand = 0;
+		nodes[i].wants = 0;
+		nodes[i].sock = createNodeSocket(nodes[i].port);
+		setTimeout(nodes[i].sock, 100000);
+	}
+	return nodes;
+}
+
+int compareLatency(const void* a, const void* b) {
+	uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Each trial marks one random node as wanting the critical section and
+// measures how long it takes for the circulating token to reach it.
+void runBenchmark(const char* name, int initial_port, int num_nodes, int num_rings, int trials) {
+	struct BenchNode* nodes = createTopology(initial_port, num_nodes, num_rings);
+	rotate_on_demand = num_rings > 1;
+	int driver = createNodeSocket(initial_port + num_nodes);
+	bench_running = 1;
+	for(int i = 0; i < num_nodes; i++) {
+		pthread_create(&nodes[i].thread, NULL, runBenchNode, &nodes[i]);
+	}
+
+	struct Response token;
+	token.TOKEN = 0xEEEEEEEEEEEEEEE;
+	strcpy(token.path_to_resource, RESOURCE_NAME);
+	sendToken(driver, &token, SUPER_GRANT, nodes[0].port);
+
+	uint64_t* latency = (uint64_t*)malloc(sizeof(uint64_t) * trials);
+	for(int t = 0; t < trials; t++) {
+		struct BenchNode* node = &nodes[rand() % num_nodes];
+		uint64_t start = now_ns();
+		pthread_mutex_lock(&served_lock);
+		node->wants = 1;
+		pthread_mutex_unlock(&served_lock);
+		sendDemand(driver, node->leader);
+		pthread_mutex_lock(&served_lock);
+		while(node->wants) {
+			pthread_cond_wait(&served_cond, &served_lock);
+		}
+		pthread_mutex_unlock(&served_lock);
+		latency[t] = now_ns() - start;
+	}
+
+	bench_running = 0;
+	for(int i = 0; i < num_nodes; i++) {
+		pthread_join(nodes[i].thread, NULL);
+		close(nodes[i].sock);
+	}
+	close(driver);
+
+	qsort(latency, trials, sizeof(uint64_t), compareLatency);
+	uint64_t sum = 0;
+	for(int t = 0; t < trials; t++) {
+		sum += latency[t];
+	}
+	printf("%-6s nodes=%d rings=%d avg=%.1fus p50=%.1fus p99=%.1fus\n", name, num_nodes, num_rings,
+			sum / 1000.0 / trials, latency[trials / 2] / 1000.0, latency[(trials * 99) / 100] / 1000.0);
+	free(latency);
+	free(nodes);
+}
+
+// ./ring_bench INITIAL_PORT NUM_NODES TRIALS
+int main(int argc, char **argv) {
+	int initial_port = (argc > 1) ? atoi(argv[1]) : (1<<13);
+	int num_nodes = (argc > 2) ? atoi(argv[2]) : 64;
+	int trials = (argc > 3) ? atoi(argv[3]) : 1000;
+	int num_rings = 1;
+	while(num_rings * num_rings < num_nodes) {
+		num_rings++;
+	}
+
+	srand(time(NULL));
+
+	runBenchmark("flat", initial_port, num_nodes, 1, trials);
+	runBenchmark("hier", initial_port + num_nodes + 1, num_nodes, num_rings, trials);
+
+	return 0;
+}
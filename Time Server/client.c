@@ -7,15 +7,24 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include "time_client.h"
 
 #define server_port (2<<13)
 #define MSG_SIZE 64
+#define DEFAULT_SAMPLES 8
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
+// ./client [CLIENT_OFFSET [-b [NUM_SAMPLES]]]
+// With -b the client takes NUM_SAMPLES binary samples and prints the
+// server's time corrected by the lowest-delay one, along with its offset
+// and delay.
 int main(int argc, char **argv) {
 	int port = (argc > 1) ? (server_port<<1)+atoi(argv[1]) : (server_port<<1);
+	int binary = (argc > 2 && strcmp(argv[2], "-b") == 0);
+	int num_samples = (argc > 3) ? atoi(argv[3]) : DEFAULT_SAMPLES;
 	
 	int sock;
 	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -40,14 +49,41 @@ int main(int argc, char **argv) {
 	server_addr.sin_port = server_port;
 	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	int i_want_time = 1;
+	if(binary) {
+		int enable = 1;
+		if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(int)) < 0) {
+			handle_error("setsockopt(SO_TIMESTAMPNS)");
+		}
+		struct timeval to = {1, 0};
+		if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&to, sizeof(struct timeval)) < 0) {
+			handle_error("setsockopt()");
+		}
+
+		struct TimeSample best;
+		int taken = timeClientBestSample(sock, (struct sockaddr*)&server_addr, num_samples, &best);
+		if(taken == 0) {
+			fprintf(stderr, "No reply from the server\n");
+			exit(EXIT_FAILURE);
+		}
+
+		time_t now = (timeClientNow() + best.offset) / TIME_CLIENT_NS_PER_SEC;
+		char current_time[MSG_SIZE];
+		strftime(current_time, MSG_SIZE, "%c", localtime(&now));
+		printf("Current time is %s\n", current_time);
+		printf("Best of %d samples: offset %lldns delay %lldns\n", taken, best.offset, best.delay);
+
+		close(sock);
+		return 0;
+	}
+
+	int i_want_time = TIME_CLIENT_TEXT;
 
 	if(sendto(sock, (int*)&i_want_time, sizeof(int), 0, (struct sockaddr*)&server_addr, sizeof(struct sockaddr)) < 0) {
 		handle_error("sendto()");
 	}
 
-	char *current_time = malloc(sizeof(MSG_SIZE));
-	if(recv(sock, (char *)current_time, MSG_SIZE, 0) < 0) {
+	char current_time[MSG_SIZE + 1] = {0};
+	if(recv(sock, current_time, MSG_SIZE, 0) < 0) {
 		handle_error("recv()");
 	}
 
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define server_port (2<<13)
+#define MSG_SIZE 64
+#define MAX_WINDOW 64
+#define NS_PER_SEC 1000000000LL
+
+#define TEXT_TIME 1
+#define BINARY_TIME 2
+
+#define handle_error(msg) \
+	do {perror(msg); exit(EXIT_FAILURE); } while (0)
+
+struct TimeRequest {
+	int mode;
+	int flags;
+	long long origin;
+};
+
+struct LoadClient {
+	int sock;
+	int window;
+	long long replies;
+	long long lost;
+	char sample[MSG_SIZE + 1];
+	pthread_t thread;
+};
+
+volatile int load_running;
+int binary_mode;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void setTimeout(int sock, int duration_ms) {
+	struct timeval to;
+	to.tv_sec = duration_ms / 1000;
+	to.tv_usec = (duration_ms % 1000) * 1000;
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&to, sizeof(struct timeval)) < 0) {
+		handle_error("setsockopt()");
+	}
+}
+
+// Sends n time requests in one sendmmsg. Text requests are the bare int
+// the original client sends.
+void sendTimeRequests(int sock, int n) {
+	struct TimeRequest req;
+	req.mode = binary_mode ? BINARY_TIME : TEXT_TIME;
+	req.flags = 0;
+	if(binary_mode) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		req.origin = (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+	}
+	struct iovec iov = {&req, binary_mode ? sizeof(struct TimeRequest) : sizeof(int)};
+	struct mmsghdr msgs[MAX_WINDOW];
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+	for(int i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_iov = &iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for(int sent = 0; sent < n; ) {
+		int r = sendmmsg(sock, msgs + sent, n - sent, 0);
+		if(r < 0) {
+			handle_error("sendmmsg()");
+		}
+		sent += r;
+	}
+}
+
+// Keeps window requests in flight, sending a new one for every reply. A
+// request whose reply does not come back within 100ms counts as lost and
+// is replaced, so drops at the server do not stall the client.
+void* runLoadClient(void* arg) {
+	struct LoadClient* client = (struct LoadClient*)arg;
+	char bufs[MAX_WINDOW][MSG_SIZE];
+	struct iovec iovs[MAX_WINDOW];
+	struct mmsghdr msgs[MAX_WINDOW];
+	memset(msgs, 0, sizeof(msgs));
+	for(int i = 0; i < MAX_WINDOW; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = MSG_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	sendTimeRequests(client->sock, client->window);
+	while(load_running) {
+		int n = recvmmsg(client->sock, msgs, client->window, MSG_WAITFORONE, NULL);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				handle_error("recvmmsg()");
+			}
+			client->lost += client->window;
+			sendTimeRequests(client->sock, client->window);
+			continue;
+		}
+		if(client->replies == 0 && !binary_mode) {
+			memcpy(client->sample, bufs[0], MSG_SIZE);
+		}
+		client->replies += n;
+		sendTimeRequests(client->sock, n);
+	}
+	return NULL;
+}
+
+// ./loadgen [-b] [NUM_CLIENTS [DURATION [WINDOW]]]
+// Each client keeps WINDOW requests in flight against the time server and
+// the run reports the replies per second it got back. Pin the server with
+// taskset to measure what it sustains on one core. With -b the requests
+// ask for binary replies instead of text.
+int main(int argc, char **argv) {
+	if(argc > 1 && strcmp(argv[1], "-b") == 0) {
+		binary_mode = 1;
+		argc--;
+		argv++;
+	}
+	int num_clients = (argc > 1) ? atoi(argv[1]) : 4;
+	int duration = (argc > 2) ? atoi(argv[2]) : 5;
+	int window = (argc > 3) ? atoi(argv[3]) : 16;
+	if(window < 1 || window > MAX_WINDOW) {
+		fprintf(stderr, "WINDOW must be between 1 and %d\n", MAX_WINDOW);
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(struct sockaddr_in));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = server_port;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	struct LoadClient* clients = (struct LoadClient*)calloc(num_clients, sizeof(struct LoadClient));
+	load_running = 1;
+	for(int i = 0; i < num_clients; i++) {
+		struct LoadClient* client = &clients[i];
+		if((client->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+			handle_error("socket()");
+		}
+		if(connect(client->sock, (struct sockaddr*)&server_addr, sizeof(struct sockaddr)) < 0) {
+			handle_error("connect()");
+		}
+		setTimeout(client->sock, 100);
+		client->window = window;
+		pthread_create(&client->thread, NULL, runLoadClient, client);
+	}
+
+	uint64_t start = now_ns();
+	sleep(duration);
+	load_running = 0;
+
+	long long replies = 0, lost = 0;
+	char* sample = NULL;
+	for(int i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		close(clients[i].sock);
+		replies += clients[i].replies;
+		lost += clients[i].lost;
+		if(sample == NULL && clients[i].replies > 0) {
+			sample = clients[i].sample;
+		}
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	printf("mode=%s clients=%d window=%d replies=%lld lost=%lld\n", binary_mode ? "binary" : "text", num_clients, window, replies, lost);
+	printf("throughput=%.1f requests/s\n", replies / elapsed);
+	if(sample != NULL && !binary_mode) {
+		printf("sample reply: %s\n", sample);
+	}
+
+	free(clients);
+
+	return 0;
+}
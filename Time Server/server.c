@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdlib.h>
@@ -6,57 +7,479 @@
 #include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+// io_uring is driven through its raw syscalls, so all it needs is the
+// kernel's uapi header. Without it -u falls back to recvmmsg.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 #define port (2<<13)
 #define MSG_SIZE 64
+#define CONTROL_LEN 64
+#define BATCH_SIZE 64
+#define NS_PER_SEC 1000000000LL
+#define URING_ENTRIES 64
+#define URING_BUFS 256
+#define URING_BUF_SIZE 256
+#define URING_BGID 0
+
+#define TEXT_TIME 1
+#define BINARY_TIME 2
 
 #define handle_error(msg) \
 	do {perror(msg); exit(EXIT_FAILURE); } while (0)
 
-char* get_current_time() {
-	time_t t = time(NULL);
-	struct tm *local = localtime(&t);
-	char *ftime = (char *)malloc(sizeof(MSG_SIZE));
-	strftime(ftime, MSG_SIZE, "%c", local);
-	return ftime;
+// A text request is just the int TEXT_TIME, as sent by the original
+// clients. A binary request carries the client's transmit time, which the
+// reply echoes as origin next to when the server received the request and
+// when it sent the reply, all in nanoseconds since the epoch.
+struct TimeRequest {
+	int mode;
+	int flags;
+	long long origin;
+};
+
+struct TimeResponse {
+	int mode;
+	int flags;
+	long long origin;
+	long long receive;
+	long long transmit;
+};
+
+struct FormattedTime {
+	time_t second;
+	char text[MSG_SIZE];
+};
+
+// Requests drained by one recvmmsg and the replies queued for one sendmmsg.
+struct RequestBatch {
+	struct mmsghdr requests[BATCH_SIZE];
+	struct iovec request_iovs[BATCH_SIZE];
+	struct sockaddr_in client_addrs[BATCH_SIZE];
+	struct TimeRequest bufs[BATCH_SIZE];
+	char control[BATCH_SIZE][CONTROL_LEN];
+	struct mmsghdr replies[BATCH_SIZE];
+	struct iovec reply_iovs[BATCH_SIZE];
+	struct TimeResponse responses[BATCH_SIZE];
+};
+
+struct Worker {
+	int id;
+	int sock;
+	int cpu;
+	int kernel_timestamps;
+	int use_uring;
+	pthread_t thread;
+};
+
+// The formatted time only changes once a second, so it is formatted once
+// per second and every reply in that second points at the same buffer.
+// Two seconds are kept so that a batch straddling a tick never rewrites a
+// reply that is still queued. Each worker has its own.
+__thread struct FormattedTime FORMATTED_TIMES[2];
+
+const char* get_current_time(time_t t) {
+	struct FormattedTime* formatted = &FORMATTED_TIMES[t & 1];
+	if(formatted->second != t) {
+		struct tm local;
+		localtime_r(&t, &local);
+		memset(formatted->text, 0, MSG_SIZE);
+		strftime(formatted->text, MSG_SIZE, "%c", &local);
+		formatted->second = t;
+	}
+	return formatted->text;
+}
+
+void init_batch(struct RequestBatch* batch) {
+	memset(batch, 0, sizeof(struct RequestBatch));
+	for(int i = 0; i < BATCH_SIZE; i++) {
+		batch->request_iovs[i].iov_base = &batch->bufs[i];
+		batch->request_iovs[i].iov_len = sizeof(struct TimeRequest);
+		batch->requests[i].msg_hdr.msg_iov = &batch->request_iovs[i];
+		batch->requests[i].msg_hdr.msg_iovlen = 1;
+		batch->replies[i].msg_hdr.msg_iov = &batch->reply_iovs[i];
+		batch->replies[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+void get_receive_timestamp(struct msghdr* msg, struct timespec* received) {
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(received, CMSG_DATA(cmsg), sizeof(struct timespec));
+		}
+	}
+}
+
+// Blocks for at least one request and drains up to BATCH_SIZE of them,
+// storing when each arrived: the kernel's receive timestamp if
+// SO_TIMESTAMPNS is on, otherwise the time recvmmsg returned.
+int receive_requests(int sock, struct RequestBatch* batch, struct timespec* received) {
+	for(int i = 0; i < BATCH_SIZE; i++) {
+		struct msghdr* msg = &batch->requests[i].msg_hdr;
+		msg->msg_name = &batch->client_addrs[i];
+		msg->msg_namelen = sizeof(struct sockaddr_in);
+		msg->msg_control = batch->control[i];
+		msg->msg_controllen = CONTROL_LEN;
+	}
+	int n = recvmmsg(sock, batch->requests, BATCH_SIZE, MSG_WAITFORONE, NULL);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	for(int i = 0; i < n; i++) {
+		received[i] = now;
+		get_receive_timestamp(&batch->requests[i].msg_hdr, &received[i]);
+	}
+	return n;
+}
+
+long long to_ns(struct timespec* ts) {
+	return (long long)ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+// Queues a reply for every request asking for the time and sends them all.
+// Binary replies are stamped with one transmit time taken just before the
+// batch goes out.
+void send_replies(int sock, struct RequestBatch* batch, int n, struct timespec* received) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long transmit = to_ns(&now);
+
+	int num_replies = 0;
+	for(int i = 0; i < n; i++) {
+		struct TimeRequest* req = &batch->bufs[i];
+		struct mmsghdr* reply = &batch->replies[num_replies];
+		if(batch->requests[i].msg_len >= sizeof(int) && req->mode == TEXT_TIME) {
+			reply->msg_hdr.msg_iov->iov_base = (void*)get_current_time(received[i].tv_sec);
+			reply->msg_hdr.msg_iov->iov_len = MSG_SIZE;
+		} else if(batch->requests[i].msg_len >= sizeof(struct TimeRequest) && req->mode == BINARY_TIME) {
+			struct TimeResponse* resp = &batch->responses[num_replies];
+			resp->mode = BINARY_TIME;
+			resp->flags = 0;
+			resp->origin = req->origin;
+			resp->receive = to_ns(&received[i]);
+			resp->transmit = transmit;
+			reply->msg_hdr.msg_iov->iov_base = resp;
+			reply->msg_hdr.msg_iov->iov_len = sizeof(struct TimeResponse);
+		} else {
+			continue;
+		}
+		reply->msg_hdr.msg_name = &batch->client_addrs[i];
+		reply->msg_hdr.msg_namelen = batch->requests[i].msg_hdr.msg_namelen;
+		num_replies++;
+	}
+	for(int sent = 0; sent < num_replies; ) {
+		int r = sendmmsg(sock, batch->replies + sent, num_replies - sent, 0);
+		if(r < 0) {
+			handle_error("sendmmsg()");
+		}
+		sent += r;
+	}
+}
+
+void serve_batched(int sock) {
+	struct RequestBatch* batch = (struct RequestBatch*)malloc(sizeof(struct RequestBatch));
+	struct timespec received[BATCH_SIZE];
+	init_batch(batch);
+	for(;;) {
+		int n = receive_requests(sock, batch, received);
+		if(n < 0) {
+			handle_error("recvmmsg()");
+		}
+		send_replies(sock, batch, n, received);
+	}
+}
+
+#ifdef HAVE_IO_URING
+// An io_uring with a ring of URING_BUFS provided buffers. One multishot
+// recvmsg keeps posting a completion per datagram, each in a buffer the
+// kernel picked from the ring, without a new submission per request.
+struct Uring {
+	int fd;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	struct io_uring_buf_ring* buf_ring;
+	char* bufs;
+	unsigned short buf_tail;
+	int to_submit;
+};
+
+// Hands buffer bid back to the kernel. The new tail is published by
+// uring_publish_buffers.
+void uring_provide_buffer(struct Uring* ring, int bid) {
+	struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFS - 1)];
+	buf->addr = (unsigned long)(ring->bufs + bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
 }
 
-int main() {
+void uring_publish_buffers(struct Uring* ring) {
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+int uring_setup(struct Uring* ring) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(struct io_uring_params));
+	memset(ring, 0, sizeof(struct Uring));
+	if((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0) {
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single_mmap) {
+		sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+	}
+	char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	char* cq = single_mmap ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		return -1;
+	}
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	ring->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = (char*)malloc(URING_BUFS * URING_BUF_SIZE);
+	if(ring->buf_ring == MAP_FAILED) {
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (unsigned long)ring->buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		return -1;
+	}
+	for(int bid = 0; bid < URING_BUFS; bid++) {
+		uring_provide_buffer(ring, bid);
+	}
+	uring_publish_buffers(ring);
+	return 0;
+}
+
+// Queues a multishot recvmsg on sock. msg only describes the layout of
+// each buffer: room for the sender's address and the control messages.
+void uring_arm_recv(struct Uring* ring, int sock, struct msghdr* msg) {
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock;
+	sqe->addr = (unsigned long)msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+// Copies the request in the buffer of a recvmsg completion into slot i of
+// the batch, so that the buffer can go straight back to the kernel.
+void uring_copy_request(struct RequestBatch* batch, int i, char* buf, int len, struct msghdr* layout, struct timespec* received) {
+	struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+	char* name = (char*)(out + 1);
+	char* control = name + layout->msg_namelen;
+	char* payload = control + layout->msg_controllen;
+	int payload_len = len - (payload - buf);
+	if(payload_len > (int)out->payloadlen) {
+		payload_len = out->payloadlen;
+	}
+	if(payload_len > (int)sizeof(struct TimeRequest)) {
+		payload_len = sizeof(struct TimeRequest);
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_control = control;
+	msg.msg_controllen = out->controllen;
+	get_receive_timestamp(&msg, received);
+
+	memcpy(&batch->bufs[i], payload, (payload_len > 0) ? payload_len : 0);
+	memcpy(&batch->client_addrs[i], name, sizeof(struct sockaddr_in));
+	batch->requests[i].msg_hdr.msg_namelen = out->namelen;
+	batch->requests[i].msg_len = (payload_len > 0) ? payload_len : 0;
+}
+
+// Serves sock from an io_uring until an error, or returns -1 right away if
+// io_uring is not available.
+int serve_uring(int sock, int kernel_timestamps) {
+	struct Uring ring;
+	if(uring_setup(&ring) < 0) {
+		return -1;
+	}
+
+	struct msghdr layout;
+	memset(&layout, 0, sizeof(struct msghdr));
+	layout.msg_namelen = sizeof(struct sockaddr_in);
+	layout.msg_controllen = kernel_timestamps ? CONTROL_LEN : 0;
+
+	struct RequestBatch* batch = (struct RequestBatch*)malloc(sizeof(struct RequestBatch));
+	struct timespec received[BATCH_SIZE];
+	init_batch(batch);
+	uring_arm_recv(&ring, sock, &layout);
+	for(;;) {
+		int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(submitted < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			handle_error("io_uring_enter()");
+		}
+		ring.to_submit -= submitted;
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		int n = 0;
+		for(; head != tail; head++) {
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			// the multishot recvmsg stops on an error, e.g. once every buffer is in use
+			if(!(cqe->flags & IORING_CQE_F_MORE)) {
+				uring_arm_recv(&ring, sock, &layout);
+			}
+			if(cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+				continue;
+			}
+			int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			received[n] = now;
+			uring_copy_request(batch, n, ring.bufs + bid * URING_BUF_SIZE, cqe->res, &layout, &received[n]);
+			uring_provide_buffer(&ring, bid);
+			if(++n == BATCH_SIZE) {
+				send_replies(sock, batch, n, received);
+				n = 0;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		uring_publish_buffers(&ring);
+		send_replies(sock, batch, n, received);
+	}
+	return 0;
+}
+#endif
+
+int open_socket(int reuseport, int kernel_timestamps) {
 	int sock;
 	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
 		handle_error("socket()");
 	}
 
+	int enable = 1;
+	if(reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+		handle_error("setsockopt(SO_REUSEPORT)");
+	}
+
 	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(struct sockaddr);
 	memset(&addr, 0, sizeof(struct sockaddr_in));
 	addr.sin_family = AF_INET;
 	addr.sin_port = port;
 	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	printf("Attempting to start server on port %d\n", port);
-
 	if(bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr)) < 0) {
 		handle_error("bind()");
 	}
 
-	printf("Listening on port %d...\n", port);
+	if(kernel_timestamps && setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(int)) < 0) {
+		handle_error("setsockopt(SO_TIMESTAMPNS)");
+	}
+	return sock;
+}
 
-	struct sockaddr client_addr;
-	int buf;
-	for(;;) {
-		if(recvfrom(sock, &buf, sizeof(int), 0, &client_addr, &addrlen) < 0) {
-			handle_error("recvfrom()");
+void* run_worker(void* arg) {
+	struct Worker* worker = (struct Worker*)arg;
+	if(worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+	}
+	if(worker->use_uring) {
+#ifdef HAVE_IO_URING
+		if(serve_uring(worker->sock, worker->kernel_timestamps) < 0) {
+			perror("io_uring");
 		}
+#endif
+		fprintf(stderr, "Worker %d: io_uring unavailable, using recvmmsg\n", worker->id);
+	}
+	serve_batched(worker->sock);
+	return NULL;
+}
 
-		char *current_time = get_current_time();
-		printf("Client %d requesting for current updates. Sending...\n", ((struct sockaddr_in*)&client_addr)->sin_port);
-		if(buf == 1 && sendto(sock, current_time, MSG_SIZE, 0, &client_addr, sizeof(struct sockaddr)) < 0) {
-			handle_error("sendto()");
+// ./server [-k] [-w NUM_WORKERS] [-u]
+// Answers TEXT_TIME requests with the %c-formatted time and BINARY_TIME
+// requests with NTP-style receive and transmit timestamps.
+// With -k every reply carries the kernel's receive timestamp of its request
+// rather than the time the server got around to reading it.
+// With -w the server runs NUM_WORKERS threads (one per core if 0), each
+// pinned to a core and reading its own SO_REUSEPORT socket, over which the
+// kernel spreads the clients. -u drives every socket from an io_uring
+// instead of recvmmsg.
+int main(int argc, char **argv) {
+	int kernel_timestamps = 0;
+	int num_workers = 1;
+	int reuseport = 0;
+	int use_uring = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "kw:u")) != -1) {
+		switch(opt) {
+			case 'k': kernel_timestamps = 1; break;
+			case 'w': num_workers = atoi(optarg); reuseport = 1; break;
+			case 'u': use_uring = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s [-k] [-w NUM_WORKERS] [-u]\n", argv[0]);
+				exit(EXIT_FAILURE);
 		}
+	}
+	int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_workers <= 0) {
+		num_workers = num_cpus;
+	}
+
+	printf("Attempting to start server on port %d\n", port);
+
+	struct Worker* workers = (struct Worker*)calloc(num_workers, sizeof(struct Worker));
+	for(int i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		workers[i].sock = open_socket(reuseport, kernel_timestamps);
+		workers[i].cpu = reuseport ? i % num_cpus : -1;
+		workers[i].kernel_timestamps = kernel_timestamps;
+		workers[i].use_uring = use_uring;
+	}
+
+	printf("Listening on port %d with %d worker%s...\n", port, num_workers, (num_workers > 1) ? "s" : "");
+	fflush(stdout);
 
-		free(current_time);
+	for(int i = 1; i < num_workers; i++) {
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
 	}
+	run_worker(&workers[0]);
 
 	return 0;
 }
@@ -0,0 +1,125 @@
+#ifndef TIME_CLIENT_H
+#define TIME_CLIENT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <time.h>
+
+// Client side of the time server's binary mode. Each query is an
+// NTP-style exchange of four timestamps: T1 when the client sent the
+// request, T2 when the server received it, T3 when the server sent the
+// reply and T4 when the client received it. Assuming the network delay
+// is the same both ways, the server's clock is
+//     offset = ((T2 - T1) + (T3 - T4)) / 2
+// ahead of the client's, measured over a round trip of
+//     delay = (T4 - T1) - (T3 - T2)
+// that is never spent at the server. The offset can only be wrong by
+// half the delay, so of several samples the one with the lowest delay is
+// the one to trust.
+//
+// T4 is the kernel's receive timestamp if the socket has SO_TIMESTAMPNS
+// on, otherwise the time recvmsg returned.
+
+#define TIME_CLIENT_TEXT 1
+#define TIME_CLIENT_BINARY 2
+#define TIME_CLIENT_CONTROL_LEN 64
+#define TIME_CLIENT_NS_PER_SEC 1000000000LL
+
+struct TimeRequest {
+	int mode;
+	int flags;
+	long long origin;
+};
+
+struct TimeResponse {
+	int mode;
+	int flags;
+	long long origin;
+	long long receive;
+	long long transmit;
+};
+
+struct TimeSample {
+	long long origin;
+	long long receive;
+	long long transmit;
+	long long destination;
+	long long offset;
+	long long delay;
+};
+
+static inline long long timeClientNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * TIME_CLIENT_NS_PER_SEC + ts.tv_nsec;
+}
+
+// Receives one reply and when it arrived.
+static inline int timeClientReceive(int sock, struct TimeResponse* resp, long long* received) {
+	char control[TIME_CLIENT_CONTROL_LEN];
+	struct iovec iov = {resp, sizeof(struct TimeResponse)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = TIME_CLIENT_CONTROL_LEN;
+	int len = recvmsg(sock, &msg, 0);
+	*received = timeClientNow();
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); len >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(struct timespec));
+			*received = (long long)ts.tv_sec * TIME_CLIENT_NS_PER_SEC + ts.tv_nsec;
+		}
+	}
+	return len;
+}
+
+// Takes one sample from the server at addr. Replies to earlier, timed out
+// queries are told apart by their origin and skipped. Returns -1 if the
+// socket's receive timeout expires first.
+static inline int timeClientQuery(int sock, struct sockaddr* addr, struct TimeSample* sample) {
+	struct TimeRequest req;
+	req.mode = TIME_CLIENT_BINARY;
+	req.flags = 0;
+	req.origin = timeClientNow();
+	if(sendto(sock, &req, sizeof(struct TimeRequest), 0, addr, sizeof(struct sockaddr)) < 0) {
+		return -1;
+	}
+
+	struct TimeResponse resp;
+	long long received;
+	do {
+		if(timeClientReceive(sock, &resp, &received) < (int)sizeof(struct TimeResponse)) {
+			return -1;
+		}
+	} while(resp.mode != TIME_CLIENT_BINARY || resp.origin != req.origin);
+
+	sample->origin = resp.origin;
+	sample->receive = resp.receive;
+	sample->transmit = resp.transmit;
+	sample->destination = received;
+	sample->offset = ((sample->receive - sample->origin) + (sample->transmit - sample->destination)) / 2;
+	sample->delay = (sample->destination - sample->origin) - (sample->transmit - sample->receive);
+	return 0;
+}
+
+// Takes num_samples samples and keeps the one with the lowest delay.
+// Returns how many samples were taken, 0 if every query timed out.
+static inline int timeClientBestSample(int sock, struct sockaddr* addr, int num_samples, struct TimeSample* best) {
+	int taken = 0;
+	for(int i = 0; i < num_samples; i++) {
+		struct TimeSample sample;
+		if(timeClientQuery(sock, addr, &sample) < 0) {
+			continue;
+		}
+		if(taken++ == 0 || sample.delay < best->delay) {
+			*best = sample;
+		}
+	}
+	return taken;
+}
+
+#endif